@@ -11,10 +11,29 @@
 #define jbAppend32(ctx, opcode, v) jbAppendBytes(ctx, opcode, (uint8_t *) &(v), 4)
 #define jbAppend64(ctx, opcode, v) jbAppendBytes(ctx, opcode, (uint8_t *) &(v), 8)
 void jbAppendBytes(jsonbContext *ctx, uint8_t opcode, uint8_t *buf, uint32_t buflen);
+bool jbEnsure(jsonbContext *ctx, uint32_t needed);
 uint32_t jbCobsEncode(uint8_t *ptr, uint32_t length, uint8_t xor, uint8_t *dst);
 uint32_t jbCobsEncodedLength(uint8_t *ptr, uint32_t length);
 uint32_t jbCobsDecode(uint8_t *ptr, uint32_t length, uint8_t xor, uint8_t *dst);
 uint32_t jbCobsGuaranteedFit(uint32_t buflen);
+#ifndef JSONB_CONFIG_NO_INT64
+uint32_t jbVarintEncode(uint64_t v, uint8_t *dst);
+#endif
+uint32_t jbTemplateEncode(jsonbTemplate *tpl);
+#ifndef JSONB_CONFIG_NO_BINZ
+uint32_t jbBinzCompress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t dstlen);
+#endif
+uint8_t jbLenLen(uint32_t len);
+void jbAppendCounted(jsonbContext *ctx, uint8_t opcode, const char *str, uint32_t strLen);
+bool jbAppendKey(jsonbContext *ctx, const char *itemName, uint32_t nameLen);
+void jbSortObject(jsonbContext *ctx);
+bool jbSkipContainer(jsonbContext *ctx);
+const char *jbMemberKey(const uint8_t *member);
+bool jbCheckRaw(const uint8_t *raw, uint32_t rawLen);
+uint32_t jbItemLen(jsonbContext *ctx, uint32_t nameLen);
+uint32_t jbFieldLen(jsonbContext *ctx, const jsonbFieldDesc *d, const uint8_t *field, uint32_t *strLen);
+void jbStoreField(jsonbContext *ctx, const jsonbFieldDesc *d, uint8_t *field, uint8_t type, void *value);
+int jbKeyCompare(const char *key, const char *itemName, uint32_t nameLen);
 
 ///
 /// JSONB FORMATTING METHODS
@@ -28,12 +47,24 @@ void jsonbFormatBegin(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowF
 {
 
     // Init context
+#ifdef JSONB_CONFIG_NO_GROW
+    (void) bufGrow;
+    ctx->growFn = NULL;
+#else
     ctx->growFn = bufGrow;
+#endif
     ctx->buf = buf;
     ctx->buflen = buflen;
     ctx->bufused = 0;
     ctx->overrun = false;
     ctx->error = false;
+    ctx->tsBegin = 0;
+    ctx->keys = NULL;
+    ctx->flags = 0;
+    ctx->depth = 0;
+    ctx->sortedDepth = 0;
+    ctx->sortedBegin = 0;
+    ctx->reserveOp = JSONB_INVALID;
 
 }
 
@@ -86,6 +117,26 @@ uint32_t jsonbBuf(jsonbContext *ctx, uint8_t **buf, uint32_t *buflen)
     return ctx->bufused;
 }
 
+// Supply a key table so that repeated item names are interned.  When formatting,
+// this must be called after jsonbFormatBegin or jsonbObjectBegin; the first
+// keysMax distinct item names are then emitted as JSONB_ITEM_DEF, and any repeat
+// of one of them as a JSONB_ITEM_REF.  When parsing, this must be called after
+// jsonbParse so that JSONB_ITEM_REF can be resolved, and the table must be at
+// least as large as the one that was used to format the buffer.
+void jsonbKeyTable(jsonbContext *ctx, uint32_t *keys, uint8_t keysMax)
+{
+    ctx->keys = keys;
+    ctx->keysMax = keysMax;
+    ctx->keysUsed = 0;
+}
+
+// Set formatting flags.  This must be called after jsonbFormatBegin or
+// jsonbObjectBegin, and affects everything appended thereafter.
+void jsonbFormatFlags(jsonbContext *ctx, uint32_t flags)
+{
+    ctx->flags = flags;
+}
+
 // Begin creating a root object
 void jsonbObjectBegin(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow)
 {
@@ -98,6 +149,18 @@ void jsonbObjectBegin(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowF
 
 }
 
+// Begin creating a root object whose members are indexed by key
+void jsonbSortedObjectBegin(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow)
+{
+
+    // Init the buffer
+    jsonbFormatBegin(ctx, buf, buflen, bufGrow);
+
+    // Add the root object
+    jsonbAddSortedObjectBegin(ctx);
+
+}
+
 // End the cobs encoding, returning how many bytes are in the buffer
 uint32_t jsonbObjectEnd(jsonbContext *ctx)
 {
@@ -114,31 +177,67 @@ uint32_t jsonbObjectEnd(jsonbContext *ctx)
 void jsonbAddObjectBegin(jsonbContext *ctx)
 {
     jbAppendBytes(ctx, JSONB_BEGIN_OBJECT, NULL, 0);
+    ctx->depth++;
 }
 void jsonbAddObjectEnd(jsonbContext *ctx)
 {
-    jbAppendBytes(ctx, JSONB_END_OBJECT, NULL, 0);
+    if (ctx->sortedBegin != 0 && ctx->depth == ctx->sortedDepth) {
+        jbSortObject(ctx);
+    } else {
+        jbAppendBytes(ctx, JSONB_END_OBJECT, NULL, 0);
+    }
+    ctx->depth--;
+}
+
+// Append an object whose members will be indexed by key when it is ended.  The
+// index is built in place, so while such an object is open item names are not
+// interned and the buffer must have room for two additional bytes per member.
+void jsonbAddSortedObjectBegin(jsonbContext *ctx)
+{
+
+    // Reserve room for the header, stashing the state of the enclosing sorted
+    // object within it until this one is ended.
+    uint8_t stash[6];
+    memcpy(&stash[0], &ctx->sortedBegin, 4);
+    memcpy(&stash[4], &ctx->sortedDepth, 2);
+    jbAppendBytes(ctx, JSONB_BEGIN_SORTED_OBJECT, stash, sizeof(stash));
+    ctx->depth++;
+    if (!ctx->overrun) {
+        ctx->sortedBegin = ctx->bufused;
+        ctx->sortedDepth = ctx->depth;
+    }
+
 }
 
 // Append an array
 void jsonbAddArrayBegin(jsonbContext *ctx)
 {
     jbAppendBytes(ctx, JSONB_BEGIN_ARRAY, NULL, 0);
+    ctx->depth++;
 }
 void jsonbAddArrayEnd(jsonbContext *ctx)
 {
     jbAppendBytes(ctx, JSONB_END_ARRAY, NULL, 0);
+    ctx->depth--;
 }
 
 // Append a null-terminated string to an array
 void jsonbAddString(jsonbContext *ctx, const char *str)
 {
+    if ((ctx->flags & JSONB_FLAG_COUNTED) != 0) {
+        jbAppendCounted(ctx, JSONB_STRING8, str, strlen(str));
+        return;
+    }
     jbAppendBytes(ctx, JSONB_STRING, (uint8_t *) str, strlen(str)+1);
 }
 
 // Append a counted string to an array
 void jsonbAddStringLen(jsonbContext *ctx, const char *str, uint32_t strLen)
 {
+    if ((ctx->flags & JSONB_FLAG_COUNTED) != 0) {
+        jbAppendCounted(ctx, JSONB_STRING8, str, strLen);
+        return;
+    }
     jbAppendBytes(ctx, JSONB_STRING, (uint8_t *) str, strLen);
     uint8_t zerobyte = 0;
     jbAppendBytes(ctx, JSONB_INVALID, &zerobyte, 1);
@@ -159,6 +258,144 @@ void jsonbAddBin(jsonbContext *ctx, uint8_t *bin, uint32_t binLen)
     jbAppendBytes(ctx, JSONB_INVALID, bin, binLen);
 }
 
+#ifndef JSONB_CONFIG_NO_BINZ
+// Append a binary payload compressed as JSONB_BINZ, into whatever room the
+// buffer has (growing it toward the uncompressed size if it can).  Only if the
+// compressed item doesn't fit or isn't smaller is the payload appended
+// uncompressed, as with jsonbAddBin.
+void jsonbAddBinCompressed(jsonbContext *ctx, uint8_t *bin, uint32_t binLen)
+{
+    uint32_t hdrlen = 1 + 4 + 4;
+    uint32_t avail = ctx->overrun ? 0 : ctx->buflen - ctx->bufused;
+#ifndef JSONB_CONFIG_NO_GROW
+    if (avail < hdrlen + binLen && ctx->growFn != NULL && !ctx->overrun) {
+        if (ctx->growFn(&ctx->buf, &ctx->buflen, hdrlen + binLen)) {
+            avail = ctx->buflen - ctx->bufused;
+        }
+    }
+#endif
+    // Compress only into what would leave the item smaller than a JSONB_BIN*
+    uint32_t binItemLen = 1 + jbLenLen(binLen) + binLen;
+    uint32_t zlen = 0;
+    if (avail > hdrlen && binItemLen > hdrlen + 1) {
+        uint32_t maxlen = avail - hdrlen;
+        if (maxlen > binItemLen - hdrlen - 1) {
+            maxlen = binItemLen - hdrlen - 1;
+        }
+        zlen = jbBinzCompress(bin, binLen, &ctx->buf[ctx->bufused+hdrlen], maxlen);
+    }
+    if (zlen == 0) {
+        jsonbAddBin(ctx, bin, binLen);
+        return;
+    }
+    uint8_t *p = &ctx->buf[ctx->bufused];
+    uint32_t len = 4 + zlen;
+    p[0] = JSONB_BINZ;
+    memcpy(&p[1], &len, 4);
+    memcpy(&p[5], &binLen, 4);
+    ctx->bufused += hdrlen + zlen;
+}
+#endif
+
+// Reserve room for a binary payload of up to maxLen bytes, returning where the
+// caller should write it (for example by DMA), or NULL if there is no room.  The
+// pointer is valid only until jsonbCommit, which must be the next call on the
+// context.  The header is sized for maxLen until then, and narrowed at commit.
+uint8_t *jsonbReserveBin(jsonbContext *ctx, uint32_t maxLen)
+{
+    if (ctx->reserveOp != JSONB_INVALID) {
+        ctx->error = true;
+        return NULL;
+    }
+    uint8_t hdrlen = 1 + jbLenLen(maxLen);
+    if (!jbEnsure(ctx, hdrlen + maxLen)) {
+        return NULL;
+    }
+    ctx->reserveOp = JSONB_BIN8;
+    ctx->reserveHdr = hdrlen;
+    ctx->reserveLen = maxLen;
+    return &ctx->buf[ctx->bufused + hdrlen];
+}
+
+// Reserve room for a string of up to maxLen bytes plus its null terminator,
+// returning where the caller should write it (for example with snprintf), or
+// NULL if there is no room.  As with jsonbReserveBin, jsonbCommit must follow.
+char *jsonbReserveString(jsonbContext *ctx, uint32_t maxLen)
+{
+    if (ctx->reserveOp != JSONB_INVALID) {
+        ctx->error = true;
+        return NULL;
+    }
+    uint8_t opcode = JSONB_STRING;
+    uint8_t hdrlen = 1;
+    if ((ctx->flags & JSONB_FLAG_COUNTED) != 0) {
+        opcode = JSONB_STRING8;
+        hdrlen += jbLenLen(maxLen);
+    }
+    if (!jbEnsure(ctx, hdrlen + maxLen + 1)) {
+        return NULL;
+    }
+    ctx->reserveOp = opcode;
+    ctx->reserveHdr = hdrlen;
+    ctx->reserveLen = maxLen;
+    return (char *) &ctx->buf[ctx->bufused + hdrlen];
+}
+
+// Commit the actual length of what was written into the reserved space
+void jsonbCommit(jsonbContext *ctx, uint32_t actualLen)
+{
+    uint8_t opcode = ctx->reserveOp;
+    ctx->reserveOp = JSONB_INVALID;
+    if (opcode == JSONB_INVALID || actualLen > ctx->reserveLen) {
+        ctx->error = true;
+        return;
+    }
+    if (ctx->overrun) {
+        return;
+    }
+
+    // Choose the narrowest header, moving the payload down to meet it if need be
+    bool isString = (opcode != JSONB_BIN8);
+    uint8_t *hdr = &ctx->buf[ctx->bufused];
+    uint8_t lenlen = 0;
+    if (opcode != JSONB_STRING) {
+        lenlen = jbLenLen(actualLen);
+        opcode += lenlen-1;
+    }
+    if (1 + lenlen < ctx->reserveHdr) {
+        memmove(&hdr[1 + lenlen], &hdr[ctx->reserveHdr], actualLen);
+    }
+    hdr[0] = opcode;
+    memcpy(&hdr[1], &actualLen, lenlen);
+    ctx->bufused += 1 + lenlen + actualLen;
+    if (isString) {
+        ctx->buf[ctx->bufused++] = '\0';
+    }
+}
+
+// Append a single value that has already been formatted, such as an object
+// built in another context and ended with jsonbAddObjectEnd rather than
+// jsonbObjectEnd so that it remains unencoded.  It is checked to be exactly one
+// complete value, and must not use interned item names.
+void jsonbAddRaw(jsonbContext *ctx, const uint8_t *raw, uint32_t rawLen)
+{
+    if (!jbCheckRaw(raw, rawLen)) {
+        ctx->error = true;
+        return;
+    }
+    jbAppendBytes(ctx, JSONB_INVALID, (uint8_t *) raw, rawLen);
+}
+
+// Append the value held in another, unencoded, formatting context
+void jsonbAddDoc(jsonbContext *ctx, const jsonbContext *doc)
+{
+    if (doc->overrun || doc->error || doc->depth != 0 || doc->tsBegin != 0 || doc->reserveOp != JSONB_INVALID) {
+        ctx->error = true;
+        return;
+    }
+    jsonbAddRaw(ctx, doc->buf, doc->bufused);
+}
+
 // Append integers to an array
 void jsonbAddInt8(jsonbContext *ctx, int8_t v)
 {
@@ -172,10 +409,12 @@ void jsonbAddInt32(jsonbContext *ctx, int32_t v)
 {
     jbAppend32(ctx, JSONB_INT32, v);
 }
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddInt64(jsonbContext *ctx, int64_t v)
 {
     jbAppend64(ctx, JSONB_INT64, v);
 }
+#endif
 
 // Append unsigned integers to an array
 void jsonbAddUint8(jsonbContext *ctx, uint8_t v)
@@ -190,10 +429,12 @@ void jsonbAddUint32(jsonbContext *ctx, uint32_t v)
 {
     jbAppend32(ctx, JSONB_UINT32, v);
 }
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddUint64(jsonbContext *ctx, uint64_t v)
 {
     jbAppend64(ctx, JSONB_UINT64, v);
 }
+#endif
 
 // Append a null or bool to an array
 void jsonbAddNull(jsonbContext *ctx)
@@ -213,6 +454,7 @@ void jsonbAddFalse(jsonbContext *ctx)
     jbAppendBytes(ctx, JSONB_FALSE, NULL, 0);
 }
 
+#ifndef JSONB_CONFIG_NO_FLOAT
 // Append a real to an array
 void jsonbAddFloat(jsonbContext *ctx, float v)
 {
@@ -230,11 +472,85 @@ void jsonbAddDouble(jsonbContext *ctx, double v)
         jbAppendBytes(ctx, JSONB_DOUBLE, (uint8_t *) &v, 8);
     }
 }
+#endif
+
+#ifndef JSONB_CONFIG_NO_INT64
+// Append a series of integers, delta-encoded against each other
+void jsonbAddTimeSeries(jsonbContext *ctx, const int64_t *v, uint32_t count)
+{
+    jsonbAddTimeSeriesBegin(ctx);
+    for (uint32_t i=0; i<count; i++) {
+        jsonbTimeSeriesAppend(ctx, v[i]);
+    }
+    jsonbAddTimeSeriesEnd(ctx);
+}
+
+// Begin a time series whose values will be streamed in by jsonbTimeSeriesAppend.
+// No other values may be added until the series is ended.
+void jsonbAddTimeSeriesBegin(jsonbContext *ctx)
+{
+    if (ctx->tsBegin != 0) {
+        ctx->error = true;
+        return;
+    }
+    uint32_t placeholder = 0;
+    jbAppend32(ctx, JSONB_TIMESERIES, placeholder);
+    ctx->tsBegin = ctx->bufused;
+    ctx->tsPrev = 0;
+}
+
+// Append a value to the time series as the zig-zag encoded delta from the previous one
+void jsonbTimeSeriesAppend(jsonbContext *ctx, int64_t v)
+{
+    if (ctx->tsBegin == 0) {
+        ctx->error = true;
+        return;
+    }
+    int64_t delta = (int64_t) ((uint64_t) v - (uint64_t) ctx->tsPrev);
+    uint64_t zigzag = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+    uint8_t varint[10];
+    jbAppendBytes(ctx, JSONB_INVALID, varint, jbVarintEncode(zigzag, varint));
+    ctx->tsPrev = v;
+}
+
+// End the time series, filling in its payload length
+void jsonbAddTimeSeriesEnd(jsonbContext *ctx)
+{
+    if (ctx->tsBegin == 0) {
+        ctx->error = true;
+        return;
+    }
+    if (!ctx->overrun) {
+        uint32_t len = ctx->bufused - ctx->tsBegin;
+        uint8_t *p = &ctx->buf[ctx->tsBegin-4];
+        p[0] = (uint8_t) len;
+        p[1] = (uint8_t) (len >> 8);
+        p[2] = (uint8_t) (len >> 16);
+        p[3] = (uint8_t) (len >> 24);
+    }
+    ctx->tsBegin = 0;
+}
+#endif
 
 // Append the start of an item
 void jsonbAddItemToObject(jsonbContext *ctx, const char *itemName)
 {
-    jbAppendBytes(ctx, JSONB_ITEM, (uint8_t *) itemName, strlen(itemName)+1);
+    jsonbAddItemWithLenToObject(ctx, itemName, strlen(itemName));
+}
+
+// Append the start of an item whose name is counted rather than null-terminated
+void jsonbAddItemWithLenToObject(jsonbContext *ctx, const char *itemName, uint32_t nameLen)
+{
+    if (ctx->keys != NULL && ctx->sortedBegin == 0 && jbAppendKey(ctx, itemName, nameLen)) {
+        return;
+    }
+    if ((ctx->flags & JSONB_FLAG_COUNTED) != 0 && nameLen < 0x100) {
+        jbAppendCounted(ctx, JSONB_ITEM8, itemName, nameLen);
+        return;
+    }
+    jbAppendBytes(ctx, JSONB_ITEM, (uint8_t *) itemName, nameLen);
+    uint8_t zerobyte = 0;
+    jbAppendBytes(ctx, JSONB_INVALID, &zerobyte, 1);
 }
 
 // Append a string item to an object
@@ -258,6 +574,27 @@ void jsonbAddBinToObject(jsonbContext *ctx, const char *itemName, uint8_t *bin,
     jsonbAddBin(ctx, bin, binLen);
 }
 
+// Append a compressed binary payload item to an object
+#ifndef JSONB_CONFIG_NO_BINZ
+void jsonbAddBinCompressedToObject(jsonbContext *ctx, const char *itemName, uint8_t *bin, uint32_t binLen)
+{
+    jsonbAddItemToObject(ctx, itemName);
+    jsonbAddBinCompressed(ctx, bin, binLen);
+}
+#endif
+
+// Append an already-formatted item to an object
+void jsonbAddRawToObject(jsonbContext *ctx, const char *itemName, const uint8_t *raw, uint32_t rawLen)
+{
+    jsonbAddItemToObject(ctx, itemName);
+    jsonbAddRaw(ctx, raw, rawLen);
+}
+void jsonbAddDocToObject(jsonbContext *ctx, const char *itemName, const jsonbContext *doc)
+{
+    jsonbAddItemToObject(ctx, itemName);
+    jsonbAddDoc(ctx, doc);
+}
+
 // Append integer items to an object
 void jsonbAddInt8ToObject(jsonbContext *ctx, const char *itemName, int8_t v)
 {
@@ -274,11 +611,13 @@ void jsonbAddInt32ToObject(jsonbContext *ctx, const char *itemName, int32_t v)
     jsonbAddItemToObject(ctx, itemName);
     jsonbAddInt32(ctx, v);
 }
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddInt64ToObject(jsonbContext *ctx, const char *itemName, int64_t v)
 {
     jsonbAddItemToObject(ctx, itemName);
     jsonbAddInt64(ctx, v);
 }
+#endif
 
 // Append unsigned integer items to an object
 void jsonbAddUint8ToObject(jsonbContext *ctx, const char *itemName, uint8_t v)
@@ -297,11 +636,13 @@ void jsonbAddUint32ToObject(jsonbContext *ctx, const char *itemName, uint32_t v)
     jsonbAddItemToObject(ctx, itemName);
     jsonbAddUint32(ctx, v);
 }
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddUint64ToObject(jsonbContext *ctx, const char *itemName, uint64_t v)
 {
     jsonbAddItemToObject(ctx, itemName);
     jsonbAddUint64(ctx, v);
 }
+#endif
 
 // Append a null or bool items to an object
 void jsonbAddNullToObject(jsonbContext *ctx, const char *itemName)
@@ -325,6 +666,7 @@ void jsonbAddFalseToObject(jsonbContext *ctx, const char *itemName)
     jsonbAddFalse(ctx);
 }
 
+#ifndef JSONB_CONFIG_NO_FLOAT
 // Append a real item to an object
 void jsonbAddFloatToObject(jsonbContext *ctx, const char *itemName, float v)
 {
@@ -336,6 +678,294 @@ void jsonbAddDoubleToObject(jsonbContext *ctx, const char *itemName, double v)
     jsonbAddItemToObject(ctx, itemName);
     jsonbAddDouble(ctx, v);
 }
+#endif
+
+#ifndef JSONB_CONFIG_NO_INT64
+// Append a time series item to an object
+void jsonbAddTimeSeriesToObject(jsonbContext *ctx, const char *itemName, const int64_t *v, uint32_t count)
+{
+    jsonbAddItemToObject(ctx, itemName);
+    jsonbAddTimeSeries(ctx, v, count);
+}
+#endif
+
+///
+/// JSONB STRUCT METHODS
+///
+
+// Append the members of a C struct to the current object, as described by a
+// descriptor table.  Unless item names are being interned, the capacity for the
+// entire struct is reserved up front and the items are written directly.
+void jsonbEncodeStruct(jsonbContext *ctx, const jsonbFieldDesc *desc, const void *obj)
+{
+    const uint8_t *base = (const uint8_t *) obj;
+    bool interning = (ctx->keys != NULL && ctx->sortedBegin == 0);
+
+    // Validate the table and size the struct
+    uint32_t total = 0;
+    for (const jsonbFieldDesc *d = desc; d->name != NULL; d++) {
+        uint32_t strLen;
+        uint32_t len = jbFieldLen(ctx, d, &base[d->offset], &strLen);
+        if (len == 0) {
+            ctx->error = true;
+            return;
+        }
+        total += jbItemLen(ctx, d->nameLen) + len;
+    }
+    if (!interning && !jbEnsure(ctx, total)) {
+        return;
+    }
+
+    // Write the items
+    for (const jsonbFieldDesc *d = desc; d->name != NULL; d++) {
+        const uint8_t *field = &base[d->offset];
+        uint32_t strLen;
+        uint32_t len = jbFieldLen(ctx, d, field, &strLen);
+        if (interning) {
+            jsonbAddItemWithLenToObject(ctx, d->name, d->nameLen);
+            if (!jbEnsure(ctx, len)) {
+                return;
+            }
+        } else {
+            uint8_t *p = &ctx->buf[ctx->bufused];
+            if ((ctx->flags & JSONB_FLAG_COUNTED) != 0) {
+                *p++ = JSONB_ITEM8;
+                *p++ = d->nameLen;
+            } else {
+                *p++ = JSONB_ITEM;
+            }
+            memcpy(p, d->name, d->nameLen);
+            p[d->nameLen] = '\0';
+            ctx->bufused += jbItemLen(ctx, d->nameLen);
+        }
+        uint8_t *p = &ctx->buf[ctx->bufused];
+        switch (d->type) {
+        case JSONB_TRUE:
+            *p = *((const bool *) field) ? JSONB_TRUE : JSONB_FALSE;
+            break;
+        case JSONB_STRING:
+            if ((ctx->flags & JSONB_FLAG_COUNTED) != 0) {
+                uint8_t lenlen = jbLenLen(strLen);
+                *p++ = JSONB_STRING8 + (lenlen-1);
+                memcpy(p, &strLen, lenlen);
+                p += lenlen;
+            } else {
+                *p++ = JSONB_STRING;
+            }
+            memcpy(p, field, strLen);
+            p[strLen] = '\0';
+            break;
+        default:
+            *p++ = d->type;
+            memcpy(p, field, d->size);
+            break;
+        }
+        ctx->bufused += len;
+    }
+
+}
+
+// Fill the members of a C struct from the items of the root object in a single
+// pass, as described by a descriptor table, returning the number of members
+// that were found.  Members whose items are absent are left untouched, and values
+// are converted to the member's type with the same rules as the jsonbGet methods.
+uint32_t jsonbDecodeStruct(jsonbContext *ctx, const jsonbFieldDesc *desc, void *obj)
+{
+    uint8_t *base = (uint8_t *) obj;
+    uint32_t fields = 0;
+    while (desc[fields].name != NULL) {
+        fields++;
+    }
+    if (fields == 0) {
+        return 0;
+    }
+
+    uint8_t type;
+    const char *key;
+    void *value;
+    jsonbEnum(ctx);
+    if (!jsonbEnumNext(ctx, NULL, &type, &key, &value) || type != JSONB_BEGIN_OBJECT) {
+        return 0;
+    }
+    uint32_t found = 0;
+    uint32_t next = 0;
+    while (jsonbEnumNext(ctx, NULL, &type, &key, &value)) {
+        if (key == NULL && type == JSONB_END_OBJECT) {
+            break;
+        }
+
+        // Look the item up, beginning just after the previous match so that items
+        // in the same order as the table are found on the first comparison
+        if (key != NULL) {
+            for (uint32_t i=0; i<fields; i++) {
+                const jsonbFieldDesc *d = &desc[next];
+                next = (next+1 < fields) ? next+1 : 0;
+                if (d->nameLen == ctx->klen && memcmp(d->name, key, ctx->klen) == 0) {
+                    jbStoreField(ctx, d, &base[d->offset], type, value);
+                    found++;
+                    break;
+                }
+            }
+        }
+
+        // Nested objects and arrays aren't decoded
+        if (type == JSONB_BEGIN_OBJECT || type == JSONB_BEGIN_ARRAY) {
+            if (!jbSkipContainer(ctx)) {
+                break;
+            }
+        }
+
+    }
+    return found;
+}
+
+// Store a single value returned by jsonbEnumNext into the struct member that
+// it is described by, converting it as jsonbDecodeStruct would
+void jsonbDecodeField(jsonbContext *ctx, const jsonbFieldDesc *desc, void *obj, uint8_t itemType, void *itemValue)
+{
+    jbStoreField(ctx, desc, &((uint8_t *) obj)[desc->offset], itemType, itemValue);
+}
+
+///
+/// JSONB TEMPLATE METHODS
+///
+
+// Append a zeroed slot for a fixed-width number, to be patched later with
+// jsonbTemplateSet.  Slots may not be placed within sorted objects, whose
+// members move when the object is ended.
+void jsonbAddSlot(jsonbContext *ctx, uint8_t opcode, jsonbSlot *slot)
+{
+    switch (opcode) {
+    case JSONB_INT8:
+    case JSONB_INT16:
+    case JSONB_INT32:
+    case JSONB_UINT8:
+    case JSONB_UINT16:
+    case JSONB_UINT32:
+#ifndef JSONB_CONFIG_NO_INT64
+    case JSONB_INT64:
+    case JSONB_UINT64:
+#endif
+#ifndef JSONB_CONFIG_NO_FLOAT
+    case JSONB_FLOAT:
+    case JSONB_DOUBLE:
+#endif
+        break;
+    default:
+        ctx->error = true;
+        return;
+    }
+    if (ctx->sortedBegin != 0) {
+        ctx->error = true;
+        return;
+    }
+    uint8_t zeroes[8] = {0};
+    jbAppendBytes(ctx, opcode, zeroes, opcode & 0x0f);
+    slot->offset = ctx->bufused - (opcode & 0x0f);
+    slot->opcode = opcode;
+}
+
+// Append a slot item to an object
+void jsonbAddSlotToObject(jsonbContext *ctx, const char *itemName, uint8_t opcode, jsonbSlot *slot)
+{
+    jsonbAddItemToObject(ctx, itemName);
+    jsonbAddSlot(ctx, opcode, slot);
+}
+
+// End the root object of a template and encode it into a separate frame buffer,
+// returning the length of the frame (which is what should be transmitted) or 0
+// if it didn't fit.  As patching a slot may change it, the length to transmit
+// is whatever the latest jsonbTemplateSet returned, or tpl->frameused.  The context's buffer must remain untouched for as long as
+// the template is in use.  So that the frame can later be re-encoded in full if
+// need be, its buffer must have room for the worst-case COBS expansion.  The
+// frame must be sent with soi2cTransactionTxRx or soi2cTransactionV, as
+// soi2cTransaction would overwrite it with the response.
+uint32_t jsonbTemplateEnd(jsonbContext *ctx, jsonbTemplate *tpl, uint8_t *frame, uint32_t framelen)
+{
+    jsonbAddObjectEnd(ctx);
+    if (ctx->overrun || ctx->error) {
+        return 0;
+    }
+    tpl->raw = ctx->buf;
+    tpl->rawlen = ctx->bufused;
+    tpl->frame = frame;
+    tpl->framelen = framelen;
+    uint32_t siglen = (sizeof(JSONB_HEADER)-1) + (sizeof(JSONB_TRAILER)-1) + 1;
+    if (framelen < siglen + 1 + tpl->rawlen + (tpl->rawlen / 254) + 1) {
+        return 0;
+    }
+    return jbTemplateEncode(tpl);
+}
+
+// Patch a slot with a value of the slot's own type, returning the length of the
+// frame, which changes if the frame has to be re-encoded in full.  Only the COBS
+// block(s) around the slot are re-encoded if possible; because a block boundary
+// is a zero byte and every block shorter than the maximum encodes to exactly its
+// own length, the re-encoded span lands at the same place in the frame and
+// nothing around it needs to move.
+uint32_t jsonbTemplateSet(jsonbTemplate *tpl, const jsonbSlot *slot, const void *v)
+{
+    uint32_t width = slot->opcode & 0x0f;
+    memcpy(&tpl->raw[slot->offset], v, width);
+
+    // Find the zero bytes outside of the slot that delimit the span to re-encode
+    uint32_t begin = slot->offset;
+    while (begin > 0 && tpl->raw[begin-1] != 0) {
+        begin--;
+    }
+    uint32_t end = slot->offset + width;
+    while (end < tpl->rawlen && tpl->raw[end] != 0) {
+        end++;
+    }
+
+    // Re-encode just that span if it can't have produced a maximum-length block,
+    // else fall back to re-encoding the entire frame
+    if (tpl->contiguous && end - begin < 254) {
+        jbCobsEncode(&tpl->raw[begin], end - begin, (uint8_t) JSONB_TERMINATOR, &tpl->frame[(sizeof(JSONB_HEADER)-1) + begin]);
+        return tpl->frameused;
+    }
+    return jbTemplateEncode(tpl);
+}
+
+// Patch a slot with an integer, converted to the slot's type, returning the
+// length of the frame
+uint32_t jsonbTemplateSetInt64(jsonbTemplate *tpl, const jsonbSlot *slot, int64_t v)
+{
+    switch (slot->opcode) {
+#ifndef JSONB_CONFIG_NO_FLOAT
+    case JSONB_FLOAT:
+    case JSONB_DOUBLE:
+        return jsonbTemplateSetDouble(tpl, slot, (double) v);
+#endif
+    }
+    // Integers are stored little-endian, so truncation keeps the low bytes
+    return jsonbTemplateSet(tpl, slot, &v);
+}
+
+#ifndef JSONB_CONFIG_NO_FLOAT
+// Patch a slot with a real, converted to the slot's type, returning the length
+// of the frame
+uint32_t jsonbTemplateSetDouble(jsonbTemplate *tpl, const jsonbSlot *slot, double v)
+{
+    switch (slot->opcode) {
+    case JSONB_FLOAT: {
+        float f = (float) v;
+        return jsonbTemplateSet(tpl, slot, &f);
+    }
+    case JSONB_DOUBLE:
+        return jsonbTemplateSet(tpl, slot, &v);
+    case JSONB_UINT8:
+    case JSONB_UINT16:
+    case JSONB_UINT32:
+    case JSONB_UINT64: {
+        uint64_t u = (uint64_t) v;
+        return jsonbTemplateSet(tpl, slot, &u);
+    }
+    }
+    int64_t i = (int64_t) v;
+    return jsonbTemplateSet(tpl, slot, &i);
+}
+#endif
 
 ///
 /// JSONB PARSING METHODS
@@ -372,6 +1002,7 @@ bool jsonbParse(jsonbContext *ctx, uint8_t *buf, uint32_t buflen)
     ctx->buflen = jbCobsDecode(buf, buflen, JSONB_TERMINATOR, buf);
     ctx->buf = buf;
     ctx->bufused = 0;
+    ctx->keys = NULL;
     return true;
 
 }
@@ -381,6 +1012,7 @@ void jsonbEnum(jsonbContext *ctx)
 {
     ctx->bufused = 0;
     ctx->opcode = JSONB_INVALID;
+    ctx->keysUsed = 0;
 }
 
 // Continue enumerating
@@ -390,14 +1022,42 @@ bool jsonbEnumNext(jsonbContext *ctx, bool *firstInObjectOrArray, uint8_t *opcod
         return false;
     }
     if (firstInObjectOrArray != NULL) {
-        *firstInObjectOrArray = (ctx->opcode == JSONB_BEGIN_OBJECT || ctx->opcode == JSONB_BEGIN_ARRAY || ctx->opcode == JSONB_INVALID);
+        *firstInObjectOrArray = (ctx->opcode == JSONB_BEGIN_OBJECT || ctx->opcode == JSONB_BEGIN_SORTED_OBJECT || ctx->opcode == JSONB_BEGIN_ARRAY || ctx->opcode == JSONB_INVALID);
     }
     ctx->opcode = ctx->buf[ctx->bufused++];
     if (opcode != NULL) {
         *opcode = ctx->opcode;
     }
     *item = NULL;
-    if (ctx->opcode == JSONB_ITEM) {
+    ctx->klen = 0;
+    if (ctx->opcode == JSONB_ITEM_REF) {
+        if (ctx->bufused >= ctx->buflen) {
+            return false;
+        }
+        uint8_t index = ctx->buf[ctx->bufused++];
+        if (ctx->keys == NULL || index >= ctx->keysUsed) {
+            return false;
+        }
+        *item = (const char *) &ctx->buf[ctx->keys[index]];
+        ctx->klen = strlen(*item);
+    } else if (ctx->opcode == JSONB_ITEM8) {
+        if (ctx->bufused >= ctx->buflen) {
+            return false;
+        }
+        uint32_t namelen = ctx->buf[ctx->bufused++];
+        if (namelen >= ctx->buflen-ctx->bufused || ctx->buf[ctx->bufused+namelen] != '\0') {
+            return false;
+        }
+        *item = (const char *) &ctx->buf[ctx->bufused];
+        ctx->klen = namelen;
+        ctx->bufused += namelen+1;
+    } else if (ctx->opcode == JSONB_ITEM || ctx->opcode == JSONB_ITEM_DEF) {
+        if (ctx->opcode == JSONB_ITEM_DEF && ctx->keys != NULL) {
+            if (ctx->keysUsed >= ctx->keysMax) {
+                return false;
+            }
+            ctx->keys[ctx->keysUsed++] = ctx->bufused;
+        }
         *item = (const char *) &ctx->buf[ctx->bufused];
         uint32_t namelen = 0;
         bool nullTerminated = false;
@@ -411,7 +1071,13 @@ bool jsonbEnumNext(jsonbContext *ctx, bool *firstInObjectOrArray, uint8_t *opcod
         if (!nullTerminated) {
             return false;
         }
+        ctx->klen = namelen-1;
         ctx->bufused += namelen;
+    }
+    if (*item != NULL) {
+        if (ctx->bufused >= ctx->buflen) {
+            return false;
+        }
         ctx->opcode = ctx->buf[ctx->bufused++];
         if (opcode != NULL) {
             *opcode = ctx->opcode;
@@ -423,6 +1089,15 @@ bool jsonbEnumNext(jsonbContext *ctx, bool *firstInObjectOrArray, uint8_t *opcod
         break;
     case JSONB_END_OBJECT:
         break;
+    case JSONB_BEGIN_SORTED_OBJECT:
+        if (ctx->buflen-ctx->bufused < 4) {
+            return false;
+        }
+        len = 4 + 2 * (ctx->buf[ctx->bufused] | (ctx->buf[ctx->bufused+1] << 8));
+        if (opcode != NULL) {
+            *opcode = JSONB_BEGIN_OBJECT;
+        }
+        break;
     case JSONB_BEGIN_ARRAY:
         break;
     case JSONB_END_ARRAY:
@@ -447,19 +1122,54 @@ bool jsonbEnumNext(jsonbContext *ctx, bool *firstInObjectOrArray, uint8_t *opcod
         }
         break;
     }
+    case JSONB_STRING8:
+    case JSONB_STRING16:
+    case JSONB_STRING24:
+    case JSONB_STRING32: {
+        uint32_t lenlen = ctx->opcode & 0x0f;
+        if (ctx->buflen-ctx->bufused < lenlen) {
+            return false;
+        }
+        for (uint32_t i=0; i<lenlen; i++) {
+            len |= (uint32_t) ctx->buf[ctx->bufused++] << (8*i);
+        }
+        if (len >= ctx->buflen-ctx->bufused || ctx->buf[ctx->bufused+len] != '\0') {
+            return false;
+        }
+        len++;
+        ctx->opcode = JSONB_STRING;
+        if (opcode != NULL) {
+            *opcode = ctx->opcode;
+        }
+        break;
+    }
     case JSONB_BIN8:
+        if (ctx->buflen-ctx->bufused < 1) {
+            return false;
+        }
         len = ctx->buf[ctx->bufused++];
         break;
     case JSONB_BIN16:
+        if (ctx->buflen-ctx->bufused < 2) {
+            return false;
+        }
         len = ctx->buf[ctx->bufused++];
         len |= (ctx->buf[ctx->bufused++] << 8);
         break;
     case JSONB_BIN24:
+        if (ctx->buflen-ctx->bufused < 3) {
+            return false;
+        }
         len = ctx->buf[ctx->bufused++];
         len |= (ctx->buf[ctx->bufused++] << 8);
         len |= (ctx->buf[ctx->bufused++] << 16);
         break;
     case JSONB_BIN32:
+    case JSONB_BINZ:
+    case JSONB_TIMESERIES:
+        if (ctx->buflen-ctx->bufused < 4) {
+            return false;
+        }
         len = ctx->buf[ctx->bufused++];
         len |= (ctx->buf[ctx->bufused++] << 8);
         len |= (ctx->buf[ctx->bufused++] << 16);
@@ -490,28 +1200,104 @@ bool jsonbEnumNext(jsonbContext *ctx, bool *firstInObjectOrArray, uint8_t *opcod
         len = 8;
         break;
     case JSONB_FLOAT:
-        len = 8;
+        len = 4;
         break;
     case JSONB_DOUBLE:
-        len = 16;
+        len = 8;
         break;
     default:
         return false;
     }
+    if (ctx->bufused > ctx->buflen || len > ctx->buflen - ctx->bufused) {
+        return false;
+    }
     * (void **) v = &ctx->buf[ctx->bufused];
+    ctx->vlen = len;
     ctx->bufused += len;
     return true;
 }
 
+// If jsonbEnumNext just returned the beginning of an object or array, skip past
+// its end so that the next call returns whatever follows it
+bool jsonbEnumSkip(jsonbContext *ctx)
+{
+    switch (ctx->opcode) {
+    case JSONB_BEGIN_OBJECT:
+    case JSONB_BEGIN_SORTED_OBJECT:
+    case JSONB_BEGIN_ARRAY:
+        return jbSkipContainer(ctx);
+    }
+    return true;
+}
+
 // Find an item by name in the current item
 bool jsonbGetObjectItem(jsonbContext *ctx, const char *itemName, uint8_t *itemType, void *itemValue)
+{
+    return jsonbGetObjectItemWithLen(ctx, itemName, strlen(itemName), itemType, itemValue);
+}
+
+// Find an item by counted name in the current item
+bool jsonbGetObjectItemWithLen(jsonbContext *ctx, const char *itemName, uint32_t nameLen, uint8_t *itemType, void *itemValue)
 {
     uint8_t type;
     const char *key;
     void *value;
     int nesting = 0;
     jsonbEnum(ctx);
-    while (jsonbEnumNext(ctx, NULL, &type, &key, &value)) {
+
+    // If the object is sorted, binary-search its index
+    if (ctx->buflen > 5 && ctx->buf[0] == JSONB_BEGIN_SORTED_OBJECT) {
+        uint32_t count = ctx->buf[1] | (ctx->buf[2] << 8);
+        const uint8_t *index = &ctx->buf[5];
+        uint32_t members = 5 + 2*count;
+        if (members > ctx->buflen) {
+            return false;
+        }
+        uint32_t lo = 0, hi = count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            uint32_t offset = members + (index[2*mid] | (index[2*mid+1] << 8));
+            if (offset >= ctx->buflen) {
+                return false;
+            }
+            const char *key = jbMemberKey(&ctx->buf[offset]);
+            if (key == NULL) {
+                return false;
+            }
+            int cmp = jbKeyCompare(key, itemName, nameLen);
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else if (cmp > 0) {
+                hi = mid;
+            } else {
+                ctx->bufused = offset;
+                ctx->opcode = JSONB_BEGIN_SORTED_OBJECT;
+                if (!jsonbEnumNext(ctx, NULL, &type, &key, &value)) {
+                    return false;
+                }
+                *itemType = type;
+                * ((void **)itemValue) = value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Names in the key table are compared by index: each definition is compared
+    // with the name once, wherever it is, and a reference then matches only if it
+    // refers to the definition that matched
+    int interned = -1;
+    while (true) {
+        uint32_t itemOffset = ctx->bufused;
+        uint8_t keysUsed = ctx->keysUsed;
+        if (!jsonbEnumNext(ctx, NULL, &type, &key, &value)) {
+            break;
+        }
+        bool defined = (ctx->keysUsed != keysUsed);
+        bool referenced = (key != NULL && ctx->keys != NULL && (const uint8_t *) key < &ctx->buf[itemOffset]);
+        if (defined && interned < 0 && ctx->klen == nameLen && memcmp(itemName, key, nameLen) == 0) {
+            interned = keysUsed;
+        }
         switch (type) {
         case JSONB_BEGIN_OBJECT:
             nesting++;
@@ -523,17 +1309,21 @@ bool jsonbGetObjectItem(jsonbContext *ctx, const char *itemName, uint8_t *itemTy
         if (nesting == 0) {
             break;
         }
-        if (nesting != 1) {
+        if (nesting != 1 || key == NULL) {
             continue;
         }
-        if (key != NULL) {
-            int l1 = strlen(itemName);
-            int l2 = strlen(key);
-            if (l1 == l2 && memcmp(itemName, key, l1) == 0) {
-                *itemType = type;
-                * ((void **)itemValue) = value;
-                return true;
-            }
+        bool match;
+        if (defined) {
+            match = (interned == keysUsed);
+        } else if (referenced) {
+            match = (interned >= 0 && key == (const char *) &ctx->buf[ctx->keys[interned]]);
+        } else {
+            match = (ctx->klen == nameLen && memcmp(itemName, key, nameLen) == 0);
+        }
+        if (match) {
+            *itemType = type;
+            * ((void **)itemValue) = value;
+            return true;
         }
     }
     return false;
@@ -555,15 +1345,27 @@ bool jsonbGetBool(jsonbContext *ctx, const char *itemName)
 
 // Get a string
 char *jsonbGetString(jsonbContext *ctx, const char *itemName)
+{
+    return jsonbGetStringLen(ctx, itemName, NULL);
+}
+
+// Get a string along with its length, excluding the null terminator
+char *jsonbGetStringLen(jsonbContext *ctx, const char *itemName, uint32_t *strLen)
 {
     uint8_t itemType;
     char *itemValue;
+    if (strLen != NULL) {
+        *strLen = 0;
+    }
     if (!jsonbGetObjectItem(ctx, itemName, &itemType, &itemValue)) {
         return (char *) "";
     }
     if (itemType != JSONB_STRING) {
         return (char *) "";
     }
+    if (strLen != NULL) {
+        *strLen = ctx->vlen-1;
+    }
     return itemValue;
 }
 
@@ -573,6 +1375,7 @@ char *jsonbGetErr(jsonbContext *ctx)
     return jsonbGetString(ctx, "err");
 }
 
+#ifndef JSONB_CONFIG_NO_FLOAT
 // Get a float
 float jsonbGetFloat(jsonbContext *ctx, const char *itemName)
 {
@@ -587,6 +1390,12 @@ double jsonbGetDouble(jsonbContext *ctx, const char *itemName)
     if (!jsonbGetObjectItem(ctx, itemName, &itemType, &itemValue)) {
         return (double) 0;
     }
+    return jsonbValueDouble(itemType, itemValue);
+}
+
+// Convert a value returned by jsonbEnumNext to a double
+double jsonbValueDouble(uint8_t itemType, const void *itemValue)
+{
     switch (itemType) {
 
     case JSONB_FLOAT: {
@@ -654,6 +1463,7 @@ double jsonbGetDouble(jsonbContext *ctx, const char *itemName)
     return (double) 0.0;
 
 }
+#endif
 
 // Get an int32
 int32_t jsonbGetInt32(jsonbContext *ctx, const char *itemName)
@@ -669,8 +1479,15 @@ int64_t jsonbGetInt64(jsonbContext *ctx, const char *itemName)
     if (!jsonbGetObjectItem(ctx, itemName, &itemType, &itemValue)) {
         return (int32_t) 0;
     }
+    return jsonbValueInt64(itemType, itemValue);
+}
+
+// Convert a value returned by jsonbEnumNext to an int64
+int64_t jsonbValueInt64(uint8_t itemType, const void *itemValue)
+{
     switch (itemType) {
 
+#ifndef JSONB_CONFIG_NO_FLOAT
     case JSONB_FLOAT: {
         float v;
         memcpy(&v, itemValue, sizeof(v));
@@ -683,6 +1500,7 @@ int64_t jsonbGetInt64(jsonbContext *ctx, const char *itemName)
         return (int64_t) v;
     }
 
+#endif
     case JSONB_UINT8: {
         uint8_t v;
         memcpy(&v, itemValue, sizeof(v));
@@ -751,8 +1569,15 @@ uint64_t jsonbGetUint64(jsonbContext *ctx, const char *itemName)
     if (!jsonbGetObjectItem(ctx, itemName, &itemType, &itemValue)) {
         return (uint64_t) 0;
     }
+    return jsonbValueUint64(itemType, itemValue);
+}
+
+// Convert a value returned by jsonbEnumNext to a uint64
+uint64_t jsonbValueUint64(uint8_t itemType, const void *itemValue)
+{
     switch (itemType) {
 
+#ifndef JSONB_CONFIG_NO_FLOAT
     case JSONB_FLOAT: {
         float v;
         memcpy(&v, itemValue, sizeof(v));
@@ -765,6 +1590,7 @@ uint64_t jsonbGetUint64(jsonbContext *ctx, const char *itemName)
         return (uint64_t) v;
     }
 
+#endif
     case JSONB_UINT8: {
         uint8_t v;
         memcpy(&v, itemValue, sizeof(v));
@@ -819,6 +1645,108 @@ uint64_t jsonbGetUint64(jsonbContext *ctx, const char *itemName)
 
 }
 
+#ifndef JSONB_CONFIG_NO_BINZ
+// Begin decompressing a JSONB_BINZ, given the value and its length as returned
+// by jsonbEnumNext, optionally returning the uncompressed length
+bool jsonbBinzBegin(jsonbBinzReader *r, const void *v, uint32_t vlen, uint32_t *binLen)
+{
+    if (vlen < 4) {
+        return false;
+    }
+    memcpy(&r->left, v, 4);
+    r->next = (const uint8_t *) v + 4;
+    r->end = (const uint8_t *) v + vlen;
+    r->tokenLeft = 0;
+    r->windowPos = 0;
+    r->filled = 0;
+    if (binLen != NULL) {
+        *binLen = r->left;
+    }
+    return true;
+}
+
+// Decompress up to buflen more bytes into buf, returning the number of bytes
+// produced, which is only less than buflen at the end of the payload or if it
+// is corrupt.  A match reaching back before the start of the payload is corrupt,
+// and ends it, rather than reading the window before it has been written.
+uint32_t jsonbBinzRead(jsonbBinzReader *r, uint8_t *buf, uint32_t buflen)
+{
+    uint32_t produced = 0;
+    while (produced < buflen && r->left > 0) {
+        if (r->tokenLeft == 0) {
+            if (r->next >= r->end) {
+                break;
+            }
+            uint8_t token = *r->next++;
+            r->match = (token & 0x80) != 0;
+            if (!r->match) {
+                r->tokenLeft = token + 1;
+            } else {
+                if (r->next >= r->end) {
+                    break;
+                }
+                r->tokenLeft = (token & 0x7f) + 3;
+                r->distance = *r->next++;
+            }
+        }
+        uint8_t b;
+        if (r->match) {
+            if (r->distance >= r->filled) {
+                r->left = 0;
+                break;
+            }
+            b = r->window[(uint8_t) (r->windowPos - r->distance - 1)];
+        } else {
+            if (r->next >= r->end) {
+                break;
+            }
+            b = *r->next++;
+        }
+        r->window[r->windowPos++] = b;
+        if (r->filled < JSONB_BINZ_WINDOW) {
+            r->filled++;
+        }
+        buf[produced++] = b;
+        r->tokenLeft--;
+        r->left--;
+    }
+    return produced;
+}
+#endif
+
+#ifndef JSONB_CONFIG_NO_INT64
+// Begin iterating over the values of a time series, given the value and its
+// length as returned by jsonbEnumNext
+void jsonbTimeSeriesEnum(jsonbTimeSeriesIter *it, const void *v, uint32_t vlen)
+{
+    it->next = (const uint8_t *) v;
+    it->end = it->next + vlen;
+    it->value = 0;
+}
+
+// Get the next value of a time series, returning false when there are no more
+bool jsonbTimeSeriesNext(jsonbTimeSeriesIter *it, int64_t *v)
+{
+    uint64_t zigzag = 0;
+    uint32_t shift = 0;
+    while (true) {
+        if (it->next >= it->end || shift >= 64) {
+            return false;
+        }
+        uint8_t b = *it->next++;
+        zigzag |= (uint64_t) (b & 0x7f) << shift;
+        shift += 7;
+        if ((b & 0x80) == 0) {
+            break;
+        }
+    }
+    int64_t delta = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+    it->value = (int64_t) ((uint64_t) it->value + (uint64_t) delta);
+    *v = it->value;
+    return true;
+}
+#endif
+
 ///
 /// JSONB INTERNAL UTILITY METHODS
 ///
@@ -829,20 +1757,410 @@ void jbAppendBytes(jsonbContext *ctx, uint8_t opcode, uint8_t *buf, uint32_t buf
     if (opcode != JSONB_INVALID) {
         needed++;
     }
+    if (jbEnsure(ctx, needed)) {
+        if (opcode != JSONB_INVALID) {
+            ctx->buf[ctx->bufused++] = opcode;
+        }
+        if (buflen > 0) {
+            memcpy(&ctx->buf[ctx->bufused], buf, buflen);
+            ctx->bufused += buflen;
+        }
+    }
+}
+
+// Encode the entire template into its frame, returning the frame length
+uint32_t jbTemplateEncode(jsonbTemplate *tpl)
+{
+    memcpy(tpl->frame, JSONB_HEADER, sizeof(JSONB_HEADER)-1);
+    uint32_t cobslen = jbCobsEncode(tpl->raw, tpl->rawlen, (uint8_t) JSONB_TERMINATOR, &tpl->frame[sizeof(JSONB_HEADER)-1]);
+    memcpy(&tpl->frame[(sizeof(JSONB_HEADER)-1)+cobslen], JSONB_TRAILER, sizeof(JSONB_TRAILER)-1);
+    tpl->frameused = (sizeof(JSONB_HEADER)-1) + cobslen + (sizeof(JSONB_TRAILER)-1);
+    tpl->frame[tpl->frameused++] = JSONB_TERMINATOR;
+    tpl->contiguous = (cobslen == tpl->rawlen + 1);
+    return tpl->frameused;
+}
+
+// Ensure that there is room to append the specified number of bytes, growing
+// the buffer if possible, else flagging an overrun
+bool jbEnsure(jsonbContext *ctx, uint32_t needed)
+{
+#if defined(JSONB_CONFIG_UNCHECKED)
+    (void) ctx;
+    (void) needed;
+    return true;
+#elif defined(JSONB_CONFIG_NO_GROW)
+    if (ctx->bufused + needed > ctx->buflen) {
+        ctx->overrun = true;
+    }
+    return !ctx->overrun;
+#else
     if (ctx->bufused + needed > ctx->buflen) {
         if (ctx->growFn == NULL || !ctx->growFn(&ctx->buf, &ctx->buflen, needed)) {
             ctx->overrun = true;
         }
     }
+    return !ctx->overrun;
+#endif
+}
+
+// Append an item name using the key table, either as a reference to a name that
+// has already been interned or as the definition of a new one.  Returns false if
+// the name isn't interned and the table is full, in which case the caller must
+// append it as a plain JSONB_ITEM.
+bool jbAppendKey(jsonbContext *ctx, const char *itemName, uint32_t nameLen)
+{
+    for (uint8_t i=0; i<ctx->keysUsed; i++) {
+        const char *key = (const char *) &ctx->buf[ctx->keys[i]];
+        if (strncmp(key, itemName, nameLen) == 0 && key[nameLen] == '\0') {
+            jbAppend8(ctx, JSONB_ITEM_REF, i);
+            return true;
+        }
+    }
+    if (ctx->keysUsed >= ctx->keysMax) {
+        return false;
+    }
+    jbAppendBytes(ctx, JSONB_ITEM_DEF, (uint8_t *) itemName, nameLen);
+    uint8_t zerobyte = 0;
+    jbAppendBytes(ctx, JSONB_INVALID, &zerobyte, 1);
     if (!ctx->overrun) {
-        if (opcode != JSONB_INVALID) {
-            ctx->buf[ctx->bufused++] = opcode;
+        ctx->keys[ctx->keysUsed++] = ctx->bufused - (nameLen+1);
+    }
+    return true;
+}
+
+// Number of bytes that an item name will occupy when written directly
+uint32_t jbItemLen(jsonbContext *ctx, uint32_t nameLen)
+{
+    if ((ctx->flags & JSONB_FLAG_COUNTED) != 0) {
+        return 1 + 1 + nameLen + 1;
+    }
+    return 1 + nameLen + 1;
+}
+
+// Number of bytes that a struct member's value will occupy, or 0 if its
+// descriptor is invalid.  For strings, also returns the length of the string.
+uint32_t jbFieldLen(jsonbContext *ctx, const jsonbFieldDesc *d, const uint8_t *field, uint32_t *strLen)
+{
+    switch (d->type) {
+    case JSONB_TRUE:
+        return (d->size == sizeof(bool)) ? 1 : 0;
+    case JSONB_STRING: {
+        const uint8_t *nul = (const uint8_t *) memchr(field, '\0', d->size);
+        *strLen = (nul == NULL) ? d->size : (uint32_t) (nul - field);
+        if ((ctx->flags & JSONB_FLAG_COUNTED) != 0) {
+            return 1 + jbLenLen(*strLen) + *strLen + 1;
         }
-        if (buflen > 0) {
-            memcpy(&ctx->buf[ctx->bufused], buf, buflen);
-            ctx->bufused += buflen;
+        return 1 + *strLen + 1;
+    }
+    case JSONB_INT8:
+    case JSONB_INT16:
+    case JSONB_INT32:
+    case JSONB_UINT8:
+    case JSONB_UINT16:
+    case JSONB_UINT32:
+#ifndef JSONB_CONFIG_NO_INT64
+    case JSONB_INT64:
+    case JSONB_UINT64:
+#endif
+#ifndef JSONB_CONFIG_NO_FLOAT
+    case JSONB_FLOAT:
+    case JSONB_DOUBLE:
+#endif
+        return (d->size == (d->type & 0x0f)) ? 1 + d->size : 0;
+    }
+    return 0;
+}
+
+// Store a value returned by jsonbEnumNext into a struct member
+void jbStoreField(jsonbContext *ctx, const jsonbFieldDesc *d, uint8_t *field, uint8_t type, void *value)
+{
+    switch (d->type) {
+    case JSONB_TRUE:
+        if (d->size == sizeof(bool)) {
+            *((bool *) field) = (type == JSONB_TRUE);
+        }
+        return;
+    case JSONB_STRING: {
+        if (d->size == 0) {
+            return;
         }
+        uint32_t len = (type == JSONB_STRING) ? ctx->vlen-1 : 0;
+        if (len > (uint32_t) d->size-1) {
+            len = d->size-1;
+        }
+        memcpy(field, value, len);
+        field[len] = '\0';
+        return;
+    }
+    }
+    if (d->size != (d->type & 0x0f)) {
+        return;
+    }
+    switch (d->type) {
+    case JSONB_INT8: {
+        int8_t v = (int8_t) jsonbValueInt64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+    case JSONB_INT16: {
+        int16_t v = (int16_t) jsonbValueInt64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+    case JSONB_INT32: {
+        int32_t v = (int32_t) jsonbValueInt64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+#ifndef JSONB_CONFIG_NO_INT64
+    case JSONB_INT64: {
+        int64_t v = jsonbValueInt64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+#endif
+    case JSONB_UINT8: {
+        uint8_t v = (uint8_t) jsonbValueUint64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+    case JSONB_UINT16: {
+        uint16_t v = (uint16_t) jsonbValueUint64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+    case JSONB_UINT32: {
+        uint32_t v = (uint32_t) jsonbValueUint64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+#ifndef JSONB_CONFIG_NO_INT64
+    case JSONB_UINT64: {
+        uint64_t v = jsonbValueUint64(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+#endif
+#ifndef JSONB_CONFIG_NO_FLOAT
+    case JSONB_FLOAT: {
+        float v = (float) jsonbValueDouble(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+    case JSONB_DOUBLE: {
+        double v = jsonbValueDouble(type, value);
+        memcpy(field, &v, sizeof(v));
+        break;
+    }
+#endif
+    }
+}
+
+// Number of bytes needed for the length prefix of a counted value
+uint8_t jbLenLen(uint32_t len)
+{
+    if (len < 0x00000100) {
+        return 1;
+    } else if (len < 0x00010000) {
+        return 2;
+    } else if (len < 0x01000000) {
+        return 3;
+    }
+    return 4;
+}
+
+// Append a counted string or item name, null-terminated so that the parser may
+// hand it back as a C string, using the narrowest length prefix that fits.  The
+// opcode must be the 8-bit-length variant of the string or item.
+void jbAppendCounted(jsonbContext *ctx, uint8_t opcode, const char *str, uint32_t strLen)
+{
+    uint8_t lenlen = jbLenLen(strLen);
+    jbAppendBytes(ctx, opcode + (lenlen-1), (uint8_t *) &strLen, lenlen);
+    jbAppendBytes(ctx, JSONB_INVALID, (uint8_t *) str, strLen);
+    uint8_t zerobyte = 0;
+    jbAppendBytes(ctx, JSONB_INVALID, &zerobyte, 1);
+}
+
+// End the innermost sorted object by inserting its index in front of its
+// members, which remain in the order in which they were appended, and then
+// restoring the state of the enclosing sorted object.
+void jbSortObject(jsonbContext *ctx)
+{
+    uint32_t begin = ctx->sortedBegin;
+    uint8_t *hdr = &ctx->buf[begin-7];
+    memcpy(&ctx->sortedBegin, &hdr[1], 4);
+    memcpy(&ctx->sortedDepth, &hdr[5], 2);
+    if (ctx->overrun || ctx->error) {
+        return;
+    }
+
+    // Count the members, each of which must be named
+    uint8_t type;
+    const char *key;
+    void *value;
+    jsonbContext walk = *ctx;
+    walk.keys = NULL;
+    walk.buflen = ctx->bufused;
+    walk.bufused = begin;
+    uint32_t count = 0;
+    while (walk.bufused < walk.buflen) {
+        if (!jsonbEnumNext(&walk, NULL, &type, &key, &value) || key == NULL) {
+            ctx->error = true;
+            return;
+        }
+        if (type == JSONB_BEGIN_OBJECT || type == JSONB_BEGIN_ARRAY) {
+            if (!jbSkipContainer(&walk)) {
+                ctx->error = true;
+                return;
+            }
+        }
+        count++;
+    }
+    uint32_t size = (ctx->bufused - begin) + 1;
+    if (count > 0xFFFF || size > 0xFFFF) {
+        ctx->error = true;
+        return;
+    }
+
+    // Make room for the index, which replaces the stash, and the end of the object
+    uint32_t indexLen = 2*count;
+    if (indexLen > 0 && !jbEnsure(ctx, indexLen-1)) {
+        return;
+    }
+    hdr = &ctx->buf[begin-7];
+    uint8_t *index = &hdr[5];
+    uint8_t *members = &index[indexLen];
+    memmove(members, &ctx->buf[begin], size-1);
+    members[size-1] = JSONB_END_OBJECT;
+    ctx->bufused = (uint32_t) (&members[size] - ctx->buf);
+    hdr[1] = (uint8_t) count;
+    hdr[2] = (uint8_t) (count >> 8);
+    hdr[3] = (uint8_t) size;
+    hdr[4] = (uint8_t) (size >> 8);
+
+    // Build the index by binary insertion, ordered by key
+    walk.buf = ctx->buf;
+    walk.buflen = ctx->bufused - 1;
+    walk.bufused = (uint32_t) (members - ctx->buf);
+    walk.opcode = JSONB_INVALID;
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t offset = walk.bufused - (uint32_t) (members - ctx->buf);
+        if (!jsonbEnumNext(&walk, NULL, &type, &key, &value)) {
+            ctx->error = true;
+            return;
+        }
+        if (type == JSONB_BEGIN_OBJECT || type == JSONB_BEGIN_ARRAY) {
+            jbSkipContainer(&walk);
+        }
+        uint32_t lo = 0, hi = i;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            const char *midKey = jbMemberKey(&members[index[2*mid] | (index[2*mid+1] << 8)]);
+            if (strcmp(midKey, key) <= 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        memmove(&index[2*(lo+1)], &index[2*lo], 2*(i-lo));
+        index[2*lo] = (uint8_t) offset;
+        index[2*lo+1] = (uint8_t) (offset >> 8);
+    }
+
+}
+
+// Skip the remainder of the object or array that jsonbEnumNext just began,
+// leaving the context positioned after its end.  This is O(1) for sorted objects.
+bool jbSkipContainer(jsonbContext *ctx)
+{
+    if (ctx->opcode == JSONB_BEGIN_SORTED_OBJECT) {
+        const uint8_t *hdr = &ctx->buf[ctx->bufused - ctx->vlen];
+        uint32_t size = hdr[2] | (hdr[3] << 8);
+        if (size > ctx->buflen - ctx->bufused) {
+            return false;
+        }
+        ctx->bufused += size;
+        ctx->opcode = JSONB_END_OBJECT;
+        return true;
     }
+    int nesting = 1;
+    while (nesting > 0) {
+        uint8_t type;
+        const char *key;
+        void *value;
+        if (!jsonbEnumNext(ctx, NULL, &type, &key, &value)) {
+            return false;
+        }
+        switch (ctx->opcode) {
+        case JSONB_BEGIN_SORTED_OBJECT:
+            if (!jbSkipContainer(ctx)) {
+                return false;
+            }
+            break;
+        case JSONB_BEGIN_OBJECT:
+        case JSONB_BEGIN_ARRAY:
+            nesting++;
+            break;
+        case JSONB_END_OBJECT:
+        case JSONB_END_ARRAY:
+            nesting--;
+            break;
+        }
+    }
+    return true;
+}
+
+// Check that a buffer holds exactly one complete, self-contained value.  Item
+// names are resolved against an empty key table, so interned names are refused.
+bool jbCheckRaw(const uint8_t *raw, uint32_t rawLen)
+{
+    uint32_t noKeys;
+    jsonbContext walk;
+    walk.buf = (uint8_t *) raw;
+    walk.buflen = rawLen;
+    walk.opcode = JSONB_INVALID;
+    jsonbKeyTable(&walk, &noKeys, 0);
+    jsonbEnum(&walk);
+    uint8_t type;
+    const char *key;
+    void *value;
+    if (!jsonbEnumNext(&walk, NULL, &type, &key, &value) || key != NULL) {
+        return false;
+    }
+    switch (type) {
+    case JSONB_END_OBJECT:
+    case JSONB_END_ARRAY:
+        return false;
+    case JSONB_BEGIN_OBJECT:
+    case JSONB_BEGIN_ARRAY:
+        if (!jbSkipContainer(&walk)) {
+            return false;
+        }
+        break;
+    }
+    return walk.bufused == rawLen;
+}
+
+// Get the name of an object member, given a pointer to its item opcode
+const char *jbMemberKey(const uint8_t *member)
+{
+    switch (member[0]) {
+    case JSONB_ITEM:
+        return (const char *) &member[1];
+    case JSONB_ITEM8:
+        return (const char *) &member[2];
+    }
+    return NULL;
+}
+
+// Compare a null-terminated key with a counted item name, in strcmp order
+int jbKeyCompare(const char *key, const char *itemName, uint32_t nameLen)
+{
+    int cmp = strncmp(key, itemName, nameLen);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (key[nameLen] == '\0') ? 0 : 1;
 }
 
 // jbCobsEncode encodes "length" bytes of data
@@ -925,6 +2243,99 @@ uint32_t jbCobsDecode(uint8_t *ptr, uint32_t length, uint8_t xor, uint8_t *dst)
     return dst - start;
 }
 
+#ifndef JSONB_CONFIG_NO_INT64
+// Encode an unsigned varint, 7 bits per byte with the high bit set on all
+// but the last byte.  Returns the number of bytes written, at most 10.
+uint32_t jbVarintEncode(uint64_t v, uint8_t *dst)
+{
+    uint32_t len = 0;
+    while (v >= 0x80) {
+        dst[len++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    dst[len++] = (uint8_t) v;
+    return len;
+}
+#endif
+
+#ifndef JSONB_CONFIG_NO_BINZ
+
+// Size of the hash table used to find matches when compressing, in bits.  The
+// table occupies two bytes of stack per entry.
+#ifndef JSONB_BINZ_HASH_BITS
+#define JSONB_BINZ_HASH_BITS        8
+#endif
+
+// Hash the three bytes at which a match might begin
+#define jbBinzHash(p) ((((uint32_t) (p)[0] << 16 | (uint32_t) (p)[1] << 8 | (p)[2]) * 2654435761u) >> (32 - JSONB_BINZ_HASH_BITS))
+
+// Compress "length" bytes at "src" into the JSONB_BINZ token stream at "dst",
+// returning the compressed length, or 0 if it would exceed "dstlen"
+uint32_t jbBinzCompress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t dstlen)
+{
+    uint16_t recent[1 << JSONB_BINZ_HASH_BITS];
+    memset(recent, 0, sizeof(recent));
+    uint32_t out = 0;
+    uint32_t pos = 0;
+    uint32_t literals = 0;
+    while (pos < length) {
+
+        // Look for a match at the most recent position with the same hash
+        uint32_t matchlen = 0;
+        uint32_t distance = 0;
+        if (pos + 3 <= length) {
+            uint32_t h = jbBinzHash(&src[pos]);
+            distance = (uint16_t) (pos - recent[h]);
+            recent[h] = (uint16_t) pos;
+            if (distance > 0 && distance <= JSONB_BINZ_WINDOW && distance <= pos) {
+                const uint8_t *cand = &src[pos-distance];
+                uint32_t maxlen = length - pos;
+                if (maxlen > 0x7f + 3) {
+                    maxlen = 0x7f + 3;
+                }
+                while (matchlen < maxlen && cand[matchlen] == src[pos+matchlen]) {
+                    matchlen++;
+                }
+            }
+        }
+
+        // Accumulate literals until a match is found or the run is full
+        if (matchlen < 3) {
+            pos++;
+            literals++;
+            if (literals < 0x80 && pos < length) {
+                continue;
+            }
+            matchlen = 0;
+        }
+
+        // Flush pending literals
+        if (literals > 0) {
+            if (out + 1 + literals > dstlen) {
+                return 0;
+            }
+            dst[out++] = (uint8_t) (literals - 1);
+            memcpy(&dst[out], &src[pos-literals], literals);
+            out += literals;
+            literals = 0;
+        }
+
+        // Emit the match
+        if (matchlen >= 3) {
+            if (out + 2 > dstlen) {
+                return 0;
+            }
+            dst[out++] = (uint8_t) (0x80 | (matchlen - 3));
+            dst[out++] = (uint8_t) (distance - 1);
+            pos += matchlen;
+        }
+
+    }
+    return out;
+}
+
+#endif // JSONB_CONFIG_NO_BINZ
+
 // Compute the maximum length of an object that can fit into the specified buffer.
 // Note that the way we compute it may leave a bit of slop at the end, including
 // one byte for a null terminator.
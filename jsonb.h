@@ -3,11 +3,32 @@
 // copyright holder including that found in the LICENSE file.
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
 #pragma once
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Build configuration.  Each of these may be defined, typically on the compiler
+// command line, to remove code that an application never uses:
+//  JSONB_CONFIG_NO_FLOAT   No formatting of, or conversion to, float and double
+//  JSONB_CONFIG_NO_INT64   No formatting of 64-bit integers or time series
+//  JSONB_CONFIG_NO_BINZ    No compressed binary values
+//  JSONB_CONFIG_NO_GROW    Buffers are fixed in size, and bufGrow is ignored
+//  JSONB_CONFIG_UNCHECKED  Formatting assumes that the buffer is large enough,
+//                          as when it is sized for a known request, and so no
+//                          longer detects overruns.  This implies NO_GROW.
+// Parsing is always bounds-checked, and values of a removed type that arrive
+// in a response are still skipped correctly.  tools/jsonbsize.sh reports the
+// size and speed of each configuration.
+#if defined(JSONB_CONFIG_UNCHECKED) && !defined(JSONB_CONFIG_NO_GROW)
+#define JSONB_CONFIG_NO_GROW
+#endif
+
 // JSONB signature that begins every jsonb object
 #define JSONB_HEADER                "{:"
 #define JSONB_TRAILER               ":}"
@@ -22,6 +43,13 @@
 #define JSONB_BEGIN_ARRAY           0x12
 #define JSONB_END_ARRAY             0x13
 
+// An object whose members are indexed by key, for binary-search lookup.  The
+// opcode is followed by the 16-bit member count, the 16-bit length of everything
+// after the index up to and including the JSONB_END_OBJECT, and then the index
+// itself: a 16-bit offset to each member, relative to the end of the index and
+// ordered by key.  This is reported by jsonbEnumNext as JSONB_BEGIN_OBJECT.
+#define JSONB_BEGIN_SORTED_OBJECT   0x14
+
 #define JSONB_NULL                  0x20
 #define JSONB_TRUE                  0x21
 #define JSONB_FALSE                 0x22
@@ -29,15 +57,40 @@
 // A UTF-8 JSON item name, null-terminated
 #define JSONB_ITEM                  0x30
 
+// A UTF-8 JSON item name, null-terminated, that is also appended to the
+// document's key table so that it may later be referenced by its index
+#define JSONB_ITEM_DEF              0x31
+
+// A reference to an item name in the key table, by its 8-bit index
+#define JSONB_ITEM_REF              0x32
+
+// A UTF-8 JSON item name, prefixed by its 8-bit length and null-terminated
+#define JSONB_ITEM8                 0x33
+
 // A UTF-8 JSON string, null-terminated
 #define JSONB_STRING                0x40
 
+// A UTF-8 JSON string, prefixed by its length and null-terminated.  These are
+// reported by jsonbEnumNext as JSONB_STRING.
+#define JSONB_STRING8               0x41
+#define JSONB_STRING16              0x42
+#define JSONB_STRING24              0x43
+#define JSONB_STRING32              0x44
+
 // A binary buffer, prefixed by its length
 #define JSONB_BIN8                  0x51
 #define JSONB_BIN16                 0x52
 #define JSONB_BIN24                 0x53
 #define JSONB_BIN32                 0x54
 
+// A compressed binary buffer, prefixed by the 32-bit length of what follows.
+// That begins with the 32-bit uncompressed length, followed by an LZ77 token
+// stream over a 256-byte window: a token byte below 0x80 is followed by that
+// many plus one literal bytes, and any other token is a match of (token & 0x7f)
+// plus three bytes, followed by a byte holding the match distance minus one.
+#define JSONB_BINZ                  0x55
+#define JSONB_BINZ_WINDOW           256
+
 // Signed integers, occupying JSON_OPCODE_LEN bytes
 #define JSONB_INT8                  0x61
 #define JSONB_INT16                 0x62
@@ -54,28 +107,120 @@
 #define JSONB_FLOAT                 0x84
 #define JSONB_DOUBLE                0x88
 
+// A series of integers, prefixed by its 32-bit payload length.  The payload is a
+// sequence of zig-zag varints, the first being the base value and each one
+// thereafter being the delta from the value preceding it.
+#define JSONB_TIMESERIES            0x90
+
+// Formatting flags
+#define JSONB_FLAG_COUNTED          0x0001      // Emit length-prefixed strings and item names
+
 typedef bool (*bufGrowFn) (uint8_t **buf, uint32_t *buflen, uint32_t growBytes);
 
 typedef struct {
     bool overrun;
     bool error;
     uint8_t opcode;
+    uint32_t flags;
     // If growFn is supplied, the caller can retrieve the pointer and size of
     // the grown buffer directly from these fields.
     bufGrowFn growFn;
     uint8_t *buf;
     uint32_t buflen;
     uint32_t bufused;
+    // Length of the value most recently returned by jsonbEnumNext, and of the
+    // item name (excluding its terminator) if one was returned
+    uint32_t vlen;
+    uint32_t klen;
+    // State of the time series currently being appended, if any
+    uint32_t tsBegin;
+    int64_t tsPrev;
+    // Optional key table, holding the buffer offsets of interned item names
+    uint32_t *keys;
+    uint8_t keysMax;
+    uint8_t keysUsed;
+    // Nesting depth while formatting, and the state of the innermost sorted object
+    uint16_t depth;
+    uint16_t sortedDepth;
+    uint32_t sortedBegin;
+    // The value reserved for direct writing, if any, pending its commit
+    uint8_t reserveOp;
+    uint8_t reserveHdr;
+    uint32_t reserveLen;
 } jsonbContext;
 
+// Describes a member of a C struct as an object item, for jsonbEncodeStruct and
+// jsonbDecodeStruct.
+// The type is the opcode of the member's C type: a number opcode whose width
+// matches the member, JSONB_TRUE for a bool, or JSONB_STRING for a char array.
+// Descriptor tables are terminated by JSONB_FIELD_END.
+typedef struct {
+    const char *name;
+    uint8_t nameLen;
+    uint8_t type;
+    uint16_t offset;
+    uint16_t size;
+} jsonbFieldDesc;
+#define JSONB_FIELD(structType, member, itemName, opcode) \
+    { itemName, sizeof(itemName)-1, opcode, offsetof(structType, member), sizeof(((structType *) 0)->member) }
+#define JSONB_FIELD_END             { NULL, 0, JSONB_INVALID, 0, 0 }
+
+// A fixed-width value within a template, identified by its offset in the
+// unencoded buffer and its opcode, whose low nibble is the width of the value
+typedef struct {
+    uint32_t offset;
+    uint8_t opcode;
+} jsonbSlot;
+
+// A formatted request kept alongside its COBS-encoded frame, so that slots may
+// be patched in both without formatting the request again.  Because the frame is
+// sent again and again, it must be sent with soi2cTransactionTxRx or
+// soi2cTransactionV, which leave the request untouched, and never with
+// soi2cTransaction, which shifts it and receives the response over it.
+typedef struct {
+    uint8_t *raw;
+    uint32_t rawlen;
+    uint8_t *frame;
+    uint32_t framelen;
+    // The length of the frame to be sent, which patching a slot may change
+    uint32_t frameused;
+    // True when no COBS block in the frame is at its maximum length, in which case
+    // each byte of raw is encoded at the same offset in the frame
+    bool contiguous;
+} jsonbTemplate;
+
+// Streaming decompressor for a JSONB_BINZ returned by jsonbEnumNext
+typedef struct {
+    const uint8_t *next;
+    const uint8_t *end;
+    uint32_t left;
+    uint8_t tokenLeft;
+    uint8_t distance;
+    bool match;
+    uint8_t windowPos;
+    uint16_t filled;
+    uint8_t window[JSONB_BINZ_WINDOW];
+} jsonbBinzReader;
+
+// Iterator over the values of a JSONB_TIMESERIES returned by jsonbEnumNext
+typedef struct {
+    const uint8_t *next;
+    const uint8_t *end;
+    int64_t value;
+} jsonbTimeSeriesIter;
+
 void jsonbFormatBegin(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow);
 uint32_t jsonbFormatEnd(jsonbContext *ctx);
 uint32_t jsonbBuf(jsonbContext *ctx, uint8_t **buf, uint32_t *buflen);
+void jsonbKeyTable(jsonbContext *ctx, uint32_t *keys, uint8_t keysMax);
+void jsonbFormatFlags(jsonbContext *ctx, uint32_t flags);
 
 void jsonbObjectBegin(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow);
+void jsonbSortedObjectBegin(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow);
 uint32_t jsonbObjectEnd(jsonbContext *ctx);
 
 void jsonbAddObjectBegin(jsonbContext *ctx);
+void jsonbAddSortedObjectBegin(jsonbContext *ctx);
 void jsonbAddObjectEnd(jsonbContext *ctx);
 
 void jsonbAddArrayBegin(jsonbContext *ctx);
@@ -84,50 +229,119 @@ void jsonbAddArrayEnd(jsonbContext *ctx);
 void jsonbAddString(jsonbContext *ctx, const char *str);
 void jsonbAddStringLen(jsonbContext *ctx, const char *str, uint32_t strLen);
 void jsonbAddBin(jsonbContext *ctx, uint8_t *bin, uint32_t binLen);
+#ifndef JSONB_CONFIG_NO_BINZ
+void jsonbAddBinCompressed(jsonbContext *ctx, uint8_t *bin, uint32_t binLen);
+#endif
 void jsonbAddInt8(jsonbContext *ctx, int8_t v);
 void jsonbAddInt16(jsonbContext *ctx, int16_t v);
 void jsonbAddInt32(jsonbContext *ctx, int32_t v);
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddInt64(jsonbContext *ctx, int64_t v);
+#endif
 void jsonbAddUint8(jsonbContext *ctx, uint8_t v);
 void jsonbAddUint16(jsonbContext *ctx, uint16_t v);
 void jsonbAddUint32(jsonbContext *ctx, uint32_t v);
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddUint64(jsonbContext *ctx, uint64_t v);
+#endif
 void jsonbAddNull(jsonbContext *ctx);
 void jsonbAddBool(jsonbContext *ctx, bool tf);
 void jsonbAddTrue(jsonbContext *ctx);
 void jsonbAddFalse(jsonbContext *ctx);
+#ifndef JSONB_CONFIG_NO_FLOAT
 void jsonbAddFloat(jsonbContext *ctx, float v);
 void jsonbAddDouble(jsonbContext *ctx, double v);
+#endif
+#ifndef JSONB_CONFIG_NO_INT64
+void jsonbAddTimeSeries(jsonbContext *ctx, const int64_t *v, uint32_t count);
+void jsonbAddTimeSeriesBegin(jsonbContext *ctx);
+void jsonbTimeSeriesAppend(jsonbContext *ctx, int64_t v);
+void jsonbAddTimeSeriesEnd(jsonbContext *ctx);
+#endif
+uint8_t *jsonbReserveBin(jsonbContext *ctx, uint32_t maxLen);
+char *jsonbReserveString(jsonbContext *ctx, uint32_t maxLen);
+void jsonbCommit(jsonbContext *ctx, uint32_t actualLen);
+void jsonbAddRaw(jsonbContext *ctx, const uint8_t *raw, uint32_t rawLen);
+void jsonbAddDoc(jsonbContext *ctx, const jsonbContext *doc);
 
 void jsonbAddItemToObject(jsonbContext *ctx, const char *itemName);
+void jsonbAddItemWithLenToObject(jsonbContext *ctx, const char *itemName, uint32_t nameLen);
 void jsonbAddStringToObject(jsonbContext *ctx, const char *itemName, const char *str);
 void jsonbAddStringWithLenToObject(jsonbContext *ctx, const char *itemName, const char *str, uint32_t strLen);
 void jsonbAddBinToObject(jsonbContext *ctx, const char *itemName, uint8_t *bin, uint32_t binLen);
+#ifndef JSONB_CONFIG_NO_BINZ
+void jsonbAddBinCompressedToObject(jsonbContext *ctx, const char *itemName, uint8_t *bin, uint32_t binLen);
+#endif
 void jsonbAddInt8ToObject(jsonbContext *ctx, const char *itemName, int8_t v);
 void jsonbAddInt16ToObject(jsonbContext *ctx, const char *itemName, int16_t v);
 void jsonbAddInt32ToObject(jsonbContext *ctx, const char *itemName, int32_t v);
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddInt64ToObject(jsonbContext *ctx, const char *itemName, int64_t v);
+#endif
 void jsonbAddUint8ToObject(jsonbContext *ctx, const char *itemName, uint8_t v);
 void jsonbAddUint16ToObject(jsonbContext *ctx, const char *itemName, uint16_t v);
 void jsonbAddUint32ToObject(jsonbContext *ctx, const char *itemName, uint32_t v);
+#ifndef JSONB_CONFIG_NO_INT64
 void jsonbAddUint64ToObject(jsonbContext *ctx, const char *itemName, uint64_t v);
+#endif
+#ifndef JSONB_CONFIG_NO_FLOAT
 void jsonbAddFloatToObject(jsonbContext *ctx, const char *itemName, float v);
 void jsonbAddDoubleToObject(jsonbContext *ctx, const char *itemName, double v);
+#endif
 void jsonbAddNullToObject(jsonbContext *ctx, const char *itemName);
 void jsonbAddTrueToObject(jsonbContext *ctx, const char *itemName);
 void jsonbAddFalseToObject(jsonbContext *ctx, const char *itemName);
 void jsonbAddBoolToObject(jsonbContext *ctx, const char *itemName, bool tf);
+#ifndef JSONB_CONFIG_NO_INT64
+void jsonbAddTimeSeriesToObject(jsonbContext *ctx, const char *itemName, const int64_t *v, uint32_t count);
+#endif
+void jsonbAddRawToObject(jsonbContext *ctx, const char *itemName, const uint8_t *raw, uint32_t rawLen);
+void jsonbAddDocToObject(jsonbContext *ctx, const char *itemName, const jsonbContext *doc);
+void jsonbEncodeStruct(jsonbContext *ctx, const jsonbFieldDesc *desc, const void *obj);
+
+void jsonbAddSlot(jsonbContext *ctx, uint8_t opcode, jsonbSlot *slot);
+void jsonbAddSlotToObject(jsonbContext *ctx, const char *itemName, uint8_t opcode, jsonbSlot *slot);
+uint32_t jsonbTemplateEnd(jsonbContext *ctx, jsonbTemplate *tpl, uint8_t *frame, uint32_t framelen);
+uint32_t jsonbTemplateSet(jsonbTemplate *tpl, const jsonbSlot *slot, const void *v);
+uint32_t jsonbTemplateSetInt64(jsonbTemplate *tpl, const jsonbSlot *slot, int64_t v);
+#ifndef JSONB_CONFIG_NO_FLOAT
+uint32_t jsonbTemplateSetDouble(jsonbTemplate *tpl, const jsonbSlot *slot, double v);
+#endif
 
 bool jsonbParse(jsonbContext *ctx, uint8_t *buf, uint32_t buflen);
 void jsonbEnum(jsonbContext *ctx);
 bool jsonbEnumNext(jsonbContext *ctx, bool *firstInObjectOrArray, uint8_t *opcode, const char **item, void *v);
+bool jsonbEnumSkip(jsonbContext *ctx);
 bool jsonbGetObjectItem(jsonbContext *ctx, const char *itemName, uint8_t *itemType, void *itemValue);
+bool jsonbGetObjectItemWithLen(jsonbContext *ctx, const char *itemName, uint32_t nameLen, uint8_t *itemType, void *itemValue);
 char *jsonbGetString(jsonbContext *ctx, const char *itemName);
+char *jsonbGetStringLen(jsonbContext *ctx, const char *itemName, uint32_t *strLen);
+#ifndef JSONB_CONFIG_NO_FLOAT
 double jsonbGetDouble(jsonbContext *ctx, const char *itemName);
 float jsonbGetFloat(jsonbContext *ctx, const char *itemName);
+#endif
 bool jsonbGetBool(jsonbContext *ctx, const char *itemName);
 int32_t jsonbGetInt32(jsonbContext *ctx, const char *itemName);
 int64_t jsonbGetInt64(jsonbContext *ctx, const char *itemName);
 uint32_t jsonbGetUint32(jsonbContext *ctx, const char *itemName);
 uint64_t jsonbGetUint64(jsonbContext *ctx, const char *itemName);
+uint32_t jsonbDecodeStruct(jsonbContext *ctx, const jsonbFieldDesc *desc, void *obj);
+void jsonbDecodeField(jsonbContext *ctx, const jsonbFieldDesc *desc, void *obj, uint8_t itemType, void *itemValue);
+#ifndef JSONB_CONFIG_NO_FLOAT
+double jsonbValueDouble(uint8_t itemType, const void *itemValue);
+#endif
+int64_t jsonbValueInt64(uint8_t itemType, const void *itemValue);
+uint64_t jsonbValueUint64(uint8_t itemType, const void *itemValue);
 char *jsonbGetErr(jsonbContext *ctx);
+#ifndef JSONB_CONFIG_NO_BINZ
+bool jsonbBinzBegin(jsonbBinzReader *r, const void *v, uint32_t vlen, uint32_t *binLen);
+uint32_t jsonbBinzRead(jsonbBinzReader *r, uint8_t *buf, uint32_t buflen);
+#endif
+#ifndef JSONB_CONFIG_NO_INT64
+void jsonbTimeSeriesEnum(jsonbTimeSeriesIter *it, const void *v, uint32_t vlen);
+bool jsonbTimeSeriesNext(jsonbTimeSeriesIter *it, int64_t *v);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
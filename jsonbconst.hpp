@@ -0,0 +1,271 @@
+// Copyright 2024 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Compile-time JSONB encoding of constant requests (C++17).  A request that
+// never changes can be fully formatted and COBS-framed by the compiler, so that
+// the resulting "{:...:}\n" bytes live in flash and cost no CPU at runtime:
+//
+//  JSONB_CONSTANT(cardVersion, 64, [](auto &b) {
+//      b.objectBegin().string("req", "card.version").objectEnd();
+//  });
+//
+// after which cardVersion is a std::array<uint8_t, N> holding exactly the
+// framed request, ready to be copied into the transmit buffer.  The builder is
+// only meant to be evaluated at compile time, where exceeding its capacity is
+// a compile error rather than an overrun.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+#if __cplusplus >= 202002L
+#include <bit>
+#endif
+
+#pragma once
+
+#include "jsonb.h"
+
+namespace jsonb {
+namespace constant {
+
+// Accumulates the unencoded JSONB of a request, up to N bytes
+template <size_t N>
+class Builder
+{
+public:
+    uint8_t buf[N] {};
+    size_t bufused = 0;
+
+    // Objects and arrays, optionally as items of the enclosing object
+    constexpr Builder &objectBegin()
+    {
+        return op(JSONB_BEGIN_OBJECT);
+    }
+    constexpr Builder &objectBegin(const char *itemName)
+    {
+        return item(itemName).objectBegin();
+    }
+    constexpr Builder &objectEnd()
+    {
+        return op(JSONB_END_OBJECT);
+    }
+    constexpr Builder &arrayBegin()
+    {
+        return op(JSONB_BEGIN_ARRAY);
+    }
+    constexpr Builder &arrayBegin(const char *itemName)
+    {
+        return item(itemName).arrayBegin();
+    }
+    constexpr Builder &arrayEnd()
+    {
+        return op(JSONB_END_ARRAY);
+    }
+
+    // The start of an item
+    constexpr Builder &item(const char *itemName)
+    {
+        op(JSONB_ITEM);
+        while (*itemName != '\0') {
+            append((uint8_t) *itemName++);
+        }
+        return append(0);
+    }
+
+    // Values, optionally as items of the enclosing object
+    constexpr Builder &string(const char *str)
+    {
+        op(JSONB_STRING);
+        while (*str != '\0') {
+            append((uint8_t) *str++);
+        }
+        return append(0);
+    }
+    constexpr Builder &string(const char *itemName, const char *str)
+    {
+        return item(itemName).string(str);
+    }
+    constexpr Builder &null()
+    {
+        return op(JSONB_NULL);
+    }
+    constexpr Builder &null(const char *itemName)
+    {
+        return item(itemName).null();
+    }
+    constexpr Builder &boolean(bool tf)
+    {
+        return op(tf ? JSONB_TRUE : JSONB_FALSE);
+    }
+    constexpr Builder &boolean(const char *itemName, bool tf)
+    {
+        return item(itemName).boolean(tf);
+    }
+    constexpr Builder &int8(int8_t v)
+    {
+        return number(JSONB_INT8, (uint64_t) v);
+    }
+    constexpr Builder &int8(const char *itemName, int8_t v)
+    {
+        return item(itemName).int8(v);
+    }
+    constexpr Builder &int16(int16_t v)
+    {
+        return number(JSONB_INT16, (uint64_t) v);
+    }
+    constexpr Builder &int16(const char *itemName, int16_t v)
+    {
+        return item(itemName).int16(v);
+    }
+    constexpr Builder &int32(int32_t v)
+    {
+        return number(JSONB_INT32, (uint64_t) v);
+    }
+    constexpr Builder &int32(const char *itemName, int32_t v)
+    {
+        return item(itemName).int32(v);
+    }
+    constexpr Builder &int64(int64_t v)
+    {
+        return number(JSONB_INT64, (uint64_t) v);
+    }
+    constexpr Builder &int64(const char *itemName, int64_t v)
+    {
+        return item(itemName).int64(v);
+    }
+    constexpr Builder &uint8(uint8_t v)
+    {
+        return number(JSONB_UINT8, v);
+    }
+    constexpr Builder &uint8(const char *itemName, uint8_t v)
+    {
+        return item(itemName).uint8(v);
+    }
+    constexpr Builder &uint16(uint16_t v)
+    {
+        return number(JSONB_UINT16, v);
+    }
+    constexpr Builder &uint16(const char *itemName, uint16_t v)
+    {
+        return item(itemName).uint16(v);
+    }
+    constexpr Builder &uint32(uint32_t v)
+    {
+        return number(JSONB_UINT32, v);
+    }
+    constexpr Builder &uint32(const char *itemName, uint32_t v)
+    {
+        return item(itemName).uint32(v);
+    }
+    constexpr Builder &uint64(uint64_t v)
+    {
+        return number(JSONB_UINT64, v);
+    }
+    constexpr Builder &uint64(const char *itemName, uint64_t v)
+    {
+        return item(itemName).uint64(v);
+    }
+#if __cplusplus >= 202002L && defined(__cpp_lib_bit_cast)
+    // Reals need std::bit_cast to be encoded at compile time
+    constexpr Builder &real(double v)
+    {
+        return number(JSONB_DOUBLE, std::bit_cast<uint64_t>(v));
+    }
+    constexpr Builder &real(const char *itemName, double v)
+    {
+        return item(itemName).real(v);
+    }
+#endif
+
+private:
+    constexpr Builder &append(uint8_t b)
+    {
+        buf[bufused++] = b;
+        return *this;
+    }
+    constexpr Builder &op(uint8_t opcode)
+    {
+        return append(opcode);
+    }
+    // Numbers are stored little-endian, occupying the width in the opcode's low nibble
+    constexpr Builder &number(uint8_t opcode, uint64_t v)
+    {
+        op(opcode);
+        for (int i=0; i<(opcode & 0x0f); i++) {
+            append((uint8_t) (v >> (8*i)));
+        }
+        return *this;
+    }
+};
+
+// Build a request by applying a function to a builder of the given capacity
+template <size_t N, typename F>
+constexpr Builder<N> build(F f)
+{
+    Builder<N> b;
+    f(b);
+    return b;
+}
+
+// Length of the framed request, including header, trailer and terminator.
+// This mirrors jbCobsEncodedLength.
+template <size_t N>
+constexpr size_t framedSize(const Builder<N> &b)
+{
+    size_t dst = 1;
+    uint8_t code = 1;
+    for (size_t i=0; i<b.bufused; i++) {
+        if (b.buf[i] != 0) {
+            dst++;
+            code++;
+        }
+        if (b.buf[i] == 0 || code == 0xFF) {
+            code = 1;
+            dst++;
+        }
+    }
+    return (sizeof(JSONB_HEADER)-1) + dst + (sizeof(JSONB_TRAILER)-1) + 1;
+}
+
+// Frame a request exactly as jsonbFormatEnd would, into an array of M bytes,
+// where M must be framedSize() of the builder.  This mirrors jbCobsEncode.
+template <size_t M, size_t N>
+constexpr std::array<uint8_t, M> frame(const Builder<N> &b)
+{
+    std::array<uint8_t, M> out {};
+    const uint8_t x = (uint8_t) JSONB_TERMINATOR;
+    size_t dst = 0;
+    for (size_t i=0; i<sizeof(JSONB_HEADER)-1; i++) {
+        out[dst++] = (uint8_t) JSONB_HEADER[i];
+    }
+    uint8_t code = 1;
+    size_t codePos = dst++;
+    for (size_t i=0; i<b.bufused; i++) {
+        uint8_t ch = b.buf[i];
+        if (ch != 0) {
+            out[dst++] = ch ^ x;
+            code++;
+        }
+        if (ch == 0 || code == 0xFF) {
+            out[codePos] = code ^ x;
+            code = 1;
+            codePos = dst++;
+        }
+    }
+    out[codePos] = code ^ x;
+    for (size_t i=0; i<sizeof(JSONB_TRAILER)-1; i++) {
+        out[dst++] = (uint8_t) JSONB_TRAILER[i];
+    }
+    out[dst++] = JSONB_TERMINATOR;
+    return out;
+}
+
+} // namespace constant
+} // namespace jsonb
+
+// Define a constexpr std::array named "name" holding the framed request built by
+// the given function, using a builder of the given capacity
+#define JSONB_CONSTANT(name, capacity, ...) \
+    static constexpr auto name##Raw = jsonb::constant::build<capacity>(__VA_ARGS__); \
+    static constexpr auto name = jsonb::constant::frame<jsonb::constant::framedSize(name##Raw)>(name##Raw)
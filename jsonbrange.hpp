@@ -0,0 +1,326 @@
+// Copyright 2024 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Forward iterators and ranges over a parsed JSONB document (C++17).  Each
+// iterator is a copy of the jsonbEnumNext state positioned at its element, so
+// that iterating allocates nothing and standard algorithms work directly on
+// the parsed buffer:
+//
+//  jsonbContext rsp;
+//  jsonbParse(&rsp, buf, buflen);
+//  for (const jsonb::Member &m : jsonb::members(rsp)) {
+//      if (m.key == "temp") {
+//          temp = m.value.asDouble();
+//      }
+//  }
+//
+// Stepping over a nested object or array uses jsonbEnumSkip, which is O(1)
+// for sorted objects because they record their own size.  Under C++20 the
+// ranges are views, and so may be used in std::ranges pipelines.  Iterators
+// over documents with interned item names must advance in document order.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
+
+#pragma once
+
+#include "jsonb.h"
+
+namespace jsonb {
+
+class ObjectRange;
+class ArrayRange;
+template <typename Elem> class Iterator;
+
+// A value within a document, which may itself be iterated if it is an object
+// or array.  Strings and binary values point into the parsed buffer.
+class Value
+{
+public:
+    uint8_t type() const noexcept
+    {
+        return op;
+    }
+    const void *data() const noexcept
+    {
+        return ptr;
+    }
+    uint32_t size() const noexcept
+    {
+        return ctx.vlen;
+    }
+
+    bool isNull() const noexcept
+    {
+        return op == JSONB_NULL;
+    }
+    bool isBool() const noexcept
+    {
+        return op == JSONB_TRUE || op == JSONB_FALSE;
+    }
+    bool isNumber() const noexcept
+    {
+        switch (op & 0xf0) {
+        case JSONB_INT8 & 0xf0:
+        case JSONB_UINT8 & 0xf0:
+        case JSONB_FLOAT & 0xf0:
+            return true;
+        }
+        return false;
+    }
+    bool isString() const noexcept
+    {
+        return op == JSONB_STRING;
+    }
+    bool isObject() const noexcept
+    {
+        return op == JSONB_BEGIN_OBJECT;
+    }
+    bool isArray() const noexcept
+    {
+        return op == JSONB_BEGIN_ARRAY;
+    }
+
+    // Conversions, yielding zero or empty for values of another kind
+    bool asBool() const noexcept
+    {
+        return op == JSONB_TRUE;
+    }
+#ifndef JSONB_CONFIG_NO_FLOAT
+    double asDouble() const noexcept
+    {
+        return jsonbValueDouble(op, ptr);
+    }
+#endif
+    int64_t asInt64() const noexcept
+    {
+        return jsonbValueInt64(op, ptr);
+    }
+    uint64_t asUint64() const noexcept
+    {
+        return jsonbValueUint64(op, ptr);
+    }
+    std::string_view asString() const noexcept
+    {
+        return isString() ? std::string_view((const char *) ptr, ctx.vlen-1) : std::string_view();
+    }
+
+    // The members or elements of the value, which are empty if it isn't an
+    // object or array respectively
+    inline ObjectRange object() const noexcept;
+    inline ArrayRange array() const noexcept;
+
+private:
+    template <typename Elem> friend class Iterator;
+    friend Value root(const jsonbContext &doc) noexcept;
+
+    // Read the next value at the context's position, returning its item name
+    bool next(const char **key) noexcept
+    {
+        void *v;
+        if (!jsonbEnumNext(&ctx, NULL, &op, key, &v)) {
+            return false;
+        }
+        ptr = v;
+        return true;
+    }
+
+    // The enumeration state just after this value's header, which for an
+    // object or array is the position of its first member or element
+    jsonbContext ctx {};
+    uint8_t op = JSONB_INVALID;
+    const void *ptr = nullptr;
+};
+
+// A member of an object
+struct Member {
+    std::string_view key;
+    Value value;
+};
+
+// Iterates the members (Elem is Member) or elements (Elem is Value) of an
+// object or array.  A default-constructed iterator is the end of any range.
+template <typename Elem>
+class Iterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Elem;
+    using difference_type = ptrdiff_t;
+    using pointer = const Elem *;
+    using reference = const Elem &;
+
+    Iterator() noexcept = default;
+    explicit Iterator(const jsonbContext &first) noexcept
+    {
+        value().ctx = first;
+        done = false;
+        read();
+    }
+
+    reference operator*() const noexcept
+    {
+        return cur;
+    }
+    pointer operator->() const noexcept
+    {
+        return &cur;
+    }
+
+    Iterator &operator++() noexcept
+    {
+        // Step over the contents of a nested object or array, if any
+        if (!jsonbEnumSkip(&value().ctx)) {
+            done = true;
+        } else {
+            read();
+        }
+        return *this;
+    }
+    Iterator operator++(int) noexcept
+    {
+        Iterator prev = *this;
+        ++*this;
+        return prev;
+    }
+
+    friend bool operator==(const Iterator &a, const Iterator &b) noexcept
+    {
+        if (a.done || b.done) {
+            return a.done == b.done;
+        }
+        return a.position() == b.position();
+    }
+    friend bool operator!=(const Iterator &a, const Iterator &b) noexcept
+    {
+        return !(a == b);
+    }
+
+private:
+    Value &value() noexcept
+    {
+        if constexpr (std::is_same_v<Elem, Member>) {
+            return cur.value;
+        } else {
+            return cur;
+        }
+    }
+    const Value &value() const noexcept
+    {
+        return const_cast<Iterator *>(this)->value();
+    }
+    uint32_t position() const noexcept
+    {
+        return value().ctx.bufused;
+    }
+
+    // Read the element at the current position, ending at the container's end
+    void read() noexcept
+    {
+        const char *key;
+        Value &v = value();
+        if (!v.next(&key) || v.op == JSONB_END_OBJECT || v.op == JSONB_END_ARRAY) {
+            done = true;
+            return;
+        }
+        if constexpr (std::is_same_v<Elem, Member>) {
+            cur.key = (key != NULL) ? std::string_view(key, v.ctx.klen) : std::string_view();
+        }
+    }
+
+    Elem cur {};
+    bool done = true;
+};
+
+using MemberIterator = Iterator<Member>;
+using ElementIterator = Iterator<Value>;
+
+// The members of an object
+class ObjectRange
+#if __cplusplus >= 202002L
+    : public std::ranges::view_interface<ObjectRange>
+#endif
+{
+public:
+    ObjectRange() noexcept = default;
+    explicit ObjectRange(const jsonbContext &first) noexcept : first(first), valid(true) {}
+
+    MemberIterator begin() const noexcept
+    {
+        return valid ? MemberIterator(first) : MemberIterator();
+    }
+    MemberIterator end() const noexcept
+    {
+        return MemberIterator();
+    }
+
+private:
+    jsonbContext first {};
+    bool valid = false;
+};
+
+// The elements of an array
+class ArrayRange
+#if __cplusplus >= 202002L
+    : public std::ranges::view_interface<ArrayRange>
+#endif
+{
+public:
+    ArrayRange() noexcept = default;
+    explicit ArrayRange(const jsonbContext &first) noexcept : first(first), valid(true) {}
+
+    ElementIterator begin() const noexcept
+    {
+        return valid ? ElementIterator(first) : ElementIterator();
+    }
+    ElementIterator end() const noexcept
+    {
+        return ElementIterator();
+    }
+
+private:
+    jsonbContext first {};
+    bool valid = false;
+};
+
+inline ObjectRange Value::object() const noexcept
+{
+    return isObject() ? ObjectRange(ctx) : ObjectRange();
+}
+
+inline ArrayRange Value::array() const noexcept
+{
+    return isArray() ? ArrayRange(ctx) : ArrayRange();
+}
+
+// The root value of a parsed document
+inline Value root(const jsonbContext &doc) noexcept
+{
+    Value v;
+    const char *key;
+    v.ctx = doc;
+    jsonbEnum(&v.ctx);
+    if (!v.next(&key)) {
+        v.op = JSONB_INVALID;
+    }
+    return v;
+}
+
+// The members of a parsed document's root object, or elements of its root array
+inline ObjectRange members(const jsonbContext &doc) noexcept
+{
+    return root(doc).object();
+}
+inline ArrayRange elements(const jsonbContext &doc) noexcept
+{
+    return root(doc).array();
+}
+
+} // namespace jsonb
@@ -5,6 +5,12 @@
 #pragma once
 
 #define notecardTransaction soi2cTransaction
+#define notecardTransactionTxRx soi2cTransactionTxRx
+#define notecardTransactionV soi2cTransactionV
+#define notecardBegin soi2cBegin
+#define notecardBeginV soi2cBeginV
+#define notecardStep soi2cStep
+#define notecardAbort soi2cAbort
 #define notecardRequestResponse soi2cRequestResponse
 #define notecardRequest soi2cRequest
 #define notecardommand soi2cCommand
@@ -0,0 +1,389 @@
+// Copyright 2024 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Header-only C++ (C++17) interface to the Notecard over jsonb and soi2c.
+// Every method is an inline forwarder to the C API, so that using it costs
+// nothing beyond the C calls it makes:
+//
+//  notecard::Request req(jctx, buf, sizeof(buf));
+//  req.add("req", "note.add");
+//  {
+//      notecard::ObjectScope body(req, "body");
+//      body.add("temp", 21.5).add("count", count);
+//  }
+//  uint32_t len = req.end();
+//
+// Item names and strings are passed as std::string_view, whose length is
+// computed at compile time for literals, so that nothing is scanned with
+// strlen.  Values are read back with get<T>(name), which dispatches on T at
+// compile time to the appropriate conversion.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <type_traits>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#pragma once
+
+#include "notecard.h"
+
+namespace notecard {
+
+// Appends values and items to the object or array being formatted in a context
+class Writer
+{
+public:
+    explicit Writer(jsonbContext &ctx) noexcept : ctx(ctx) {}
+
+    jsonbContext &context() const noexcept
+    {
+        return ctx;
+    }
+
+    // The start of an item
+    Writer &item(std::string_view name) noexcept
+    {
+        jsonbAddItemWithLenToObject(&ctx, name.data(), (uint32_t) name.size());
+        return *this;
+    }
+
+    // Values
+    Writer &add(std::string_view str) noexcept
+    {
+        jsonbAddStringLen(&ctx, str.data(), (uint32_t) str.size());
+        return *this;
+    }
+    // Without this, a pointer would be converted to bool rather than to string_view
+    Writer &add(const char *str) noexcept
+    {
+        return add(std::string_view(str));
+    }
+    Writer &add(std::nullptr_t) noexcept
+    {
+        jsonbAddNull(&ctx);
+        return *this;
+    }
+    Writer &add(bool tf) noexcept
+    {
+        jsonbAddBool(&ctx, tf);
+        return *this;
+    }
+#ifndef JSONB_CONFIG_NO_FLOAT
+    Writer &add(float v) noexcept
+    {
+        jsonbAddFloat(&ctx, v);
+        return *this;
+    }
+    Writer &add(double v) noexcept
+    {
+        jsonbAddDouble(&ctx, v);
+        return *this;
+    }
+#else
+    // Without this, a floating-point value would be converted to bool
+    template <typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+    Writer &add(T) noexcept
+    {
+        static_assert(!std::is_floating_point_v<T>, "floating-point values are disabled by JSONB_CONFIG_NO_FLOAT");
+        return *this;
+    }
+#endif
+    template <typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+    Writer &add(T v) noexcept
+    {
+        // Integers are encoded at the width of their type
+        if constexpr (std::is_signed_v<T>) {
+            if constexpr (sizeof(T) == 1) {
+                jsonbAddInt8(&ctx, (int8_t) v);
+            } else if constexpr (sizeof(T) == 2) {
+                jsonbAddInt16(&ctx, (int16_t) v);
+            } else if constexpr (sizeof(T) == 4) {
+                jsonbAddInt32(&ctx, (int32_t) v);
+            } else {
+#ifdef JSONB_CONFIG_NO_INT64
+                static_assert(sizeof(T) < 8, "64-bit integers are disabled by JSONB_CONFIG_NO_INT64");
+#else
+                jsonbAddInt64(&ctx, (int64_t) v);
+#endif
+            }
+        } else {
+            if constexpr (sizeof(T) == 1) {
+                jsonbAddUint8(&ctx, (uint8_t) v);
+            } else if constexpr (sizeof(T) == 2) {
+                jsonbAddUint16(&ctx, (uint16_t) v);
+            } else if constexpr (sizeof(T) == 4) {
+                jsonbAddUint32(&ctx, (uint32_t) v);
+            } else {
+#ifdef JSONB_CONFIG_NO_INT64
+                static_assert(sizeof(T) < 8, "64-bit integers are disabled by JSONB_CONFIG_NO_INT64");
+#else
+                jsonbAddUint64(&ctx, (uint64_t) v);
+#endif
+            }
+        }
+        return *this;
+    }
+    Writer &bin(const uint8_t *bin, size_t binLen) noexcept
+    {
+        jsonbAddBin(&ctx, const_cast<uint8_t *>(bin), (uint32_t) binLen);
+        return *this;
+    }
+#if __cplusplus >= 202002L
+    Writer &add(std::span<const uint8_t> bin) noexcept
+    {
+        return this->bin(bin.data(), bin.size());
+    }
+#endif
+
+    // Items of the enclosing object
+    template <typename V>
+    Writer &add(std::string_view name, V &&v) noexcept
+    {
+        item(name);
+        return add(std::forward<V>(v));
+    }
+    Writer &bin(std::string_view name, const uint8_t *bin, size_t binLen) noexcept
+    {
+        item(name);
+        return this->bin(bin, binLen);
+    }
+
+protected:
+    jsonbContext &ctx;
+};
+
+// A nested object, ended when the scope is left
+class ObjectScope : public Writer
+{
+public:
+    explicit ObjectScope(Writer &parent) noexcept : Writer(parent.context())
+    {
+        jsonbAddObjectBegin(&ctx);
+    }
+    ObjectScope(Writer &parent, std::string_view name) noexcept : Writer(parent.context())
+    {
+        item(name);
+        jsonbAddObjectBegin(&ctx);
+    }
+    ~ObjectScope()
+    {
+        jsonbAddObjectEnd(&ctx);
+    }
+    ObjectScope(const ObjectScope &) = delete;
+    ObjectScope &operator=(const ObjectScope &) = delete;
+};
+
+// A nested array, ended when the scope is left
+class ArrayScope : public Writer
+{
+public:
+    explicit ArrayScope(Writer &parent) noexcept : Writer(parent.context())
+    {
+        jsonbAddArrayBegin(&ctx);
+    }
+    ArrayScope(Writer &parent, std::string_view name) noexcept : Writer(parent.context())
+    {
+        item(name);
+        jsonbAddArrayBegin(&ctx);
+    }
+    ~ArrayScope()
+    {
+        jsonbAddArrayEnd(&ctx);
+    }
+    ArrayScope(const ArrayScope &) = delete;
+    ArrayScope &operator=(const ArrayScope &) = delete;
+};
+
+// The root object of a request.  Because ending it yields the length of the
+// encoded request, it is ended explicitly rather than by its destructor.
+class Request : public Writer
+{
+public:
+    Request(jsonbContext &ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow = nullptr) noexcept : Writer(ctx)
+    {
+        jsonbObjectBegin(&ctx, buf, buflen, bufGrow);
+    }
+#if __cplusplus >= 202002L
+    Request(jsonbContext &ctx, std::span<uint8_t> buf, bufGrowFn bufGrow = nullptr) noexcept
+        : Request(ctx, buf.data(), (uint32_t) buf.size(), bufGrow) {}
+#endif
+    uint32_t end() noexcept
+    {
+        return jsonbObjectEnd(&ctx);
+    }
+};
+
+// Finds and converts the items of a parsed object
+class Reader
+{
+public:
+    explicit Reader(jsonbContext &ctx) noexcept : ctx(ctx) {}
+
+    jsonbContext &context() const noexcept
+    {
+        return ctx;
+    }
+
+    // Parse a received buffer in place
+    bool parse(uint8_t *buf, uint32_t buflen) noexcept
+    {
+        return jsonbParse(&ctx, buf, buflen);
+    }
+
+    // Find an item, returning its opcode and a pointer to its value
+    bool find(std::string_view name, uint8_t &type, const void *&value) const noexcept
+    {
+        void *v;
+        if (!jsonbGetObjectItemWithLen(&ctx, name.data(), (uint32_t) name.size(), &type, &v)) {
+            return false;
+        }
+        value = v;
+        return true;
+    }
+
+    bool has(std::string_view name) const noexcept
+    {
+        uint8_t type;
+        const void *value;
+        return find(name, type, value);
+    }
+
+    // Get an item converted to T, which may be bool, an arithmetic type or
+    // std::string_view, or the default if it is absent or of another kind.
+    // A string_view refers to the parsed buffer, and is NUL-terminated there.
+    template <typename T>
+    T get(std::string_view name, T def = T()) const noexcept
+    {
+        uint8_t type;
+        const void *value;
+        if (!find(name, type, value)) {
+            return def;
+        }
+        if constexpr (std::is_same_v<T, bool>) {
+            return (type == JSONB_TRUE) ? true : (type == JSONB_FALSE) ? false : def;
+        } else if constexpr (std::is_same_v<T, std::string_view>) {
+            return (type == JSONB_STRING) ? std::string_view((const char *) value, ctx.vlen-1) : def;
+#ifndef JSONB_CONFIG_NO_FLOAT
+        } else if constexpr (std::is_floating_point_v<T>) {
+            return isNumber(type) ? (T) jsonbValueDouble(type, value) : def;
+#endif
+        } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            return isNumber(type) ? (T) jsonbValueInt64(type, value) : def;
+        } else if constexpr (std::is_integral_v<T>) {
+            return isNumber(type) ? (T) jsonbValueUint64(type, value) : def;
+        } else {
+            static_assert(std::is_same_v<T, void>, "unsupported item type");
+        }
+    }
+
+    std::string_view getString(std::string_view name) const noexcept
+    {
+        return get<std::string_view>(name);
+    }
+
+    std::string_view getErr() const noexcept
+    {
+        return get<std::string_view>("err");
+    }
+
+private:
+    static constexpr bool isNumber(uint8_t type) noexcept
+    {
+        switch (type & 0xf0) {
+        case JSONB_INT8 & 0xf0:
+        case JSONB_UINT8 & 0xf0:
+        case JSONB_FLOAT & 0xf0:
+            return true;
+        }
+        return false;
+    }
+
+    jsonbContext &ctx;
+};
+
+// Transactions with a Notecard over a configured soi2c context
+class Transport
+{
+public:
+    explicit Transport(soi2cContext_t &ctx) noexcept : ctx(ctx) {}
+
+    soi2cContext_t &context() const noexcept
+    {
+        return ctx;
+    }
+
+    int reset() noexcept
+    {
+        return soi2cReset(&ctx);
+    }
+    int setTiming(const soi2cTiming_t *timing) noexcept
+    {
+        return soi2cSetTiming(&ctx, timing);
+    }
+    int transaction(uint32_t flags, uint8_t *buf, uint32_t buflen) noexcept
+    {
+        return soi2cTransaction(&ctx, flags, buf, buflen);
+    }
+    int transaction(uint32_t flags, const uint8_t *txbuf, uint32_t txlen, uint8_t *rxbuf, uint32_t rxlen) noexcept
+    {
+        return soi2cTransactionTxRx(&ctx, flags, txbuf, txlen, rxbuf, rxlen);
+    }
+    int transaction(uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint8_t *rxbuf, uint32_t rxlen) noexcept
+    {
+        return soi2cTransactionV(&ctx, flags, seg, segCount, rxbuf, rxlen);
+    }
+    int requestResponse(uint8_t *buf, uint32_t buflen) noexcept
+    {
+        return soi2cTransaction(&ctx, 0, buf, buflen);
+    }
+    int request(uint8_t *buf, uint32_t buflen) noexcept
+    {
+        return soi2cTransaction(&ctx, SOI2C_IGNORE_RESPONSE, buf, buflen);
+    }
+    int command(uint8_t *buf, uint32_t buflen) noexcept
+    {
+        return soi2cTransaction(&ctx, SOI2C_NO_RESPONSE, buf, buflen);
+    }
+
+    // Non-blocking transactions, advanced by step() until it no longer returns
+    // STATUS_PENDING
+    int begin(uint32_t flags, uint8_t *buf, uint32_t buflen) noexcept
+    {
+        return soi2cBegin(&ctx, flags, buf, buflen);
+    }
+    int begin(uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint8_t *rxbuf, uint32_t rxlen) noexcept
+    {
+        return soi2cBeginV(&ctx, flags, seg, segCount, rxbuf, rxlen);
+    }
+    int step(uint32_t &waitUs, bool &untilReady) noexcept
+    {
+        return soi2cStep(&ctx, &waitUs, &untilReady);
+    }
+    void abort() noexcept
+    {
+        soi2cAbort(&ctx);
+    }
+
+    // Send a request formatted into a jsonb context, whose buffer is reused
+    // for the response
+    int requestResponse(jsonbContext &req) noexcept
+    {
+        return soi2cTransaction(&ctx, 0, req.buf, req.buflen);
+    }
+
+    // Send a request formatted into a jsonb context, receiving the response into
+    // a separate buffer so that the request may be sent again
+    int requestResponse(const jsonbContext &req, uint8_t *rxbuf, uint32_t rxlen) noexcept
+    {
+        return soi2cTransactionTxRx(&ctx, 0, req.buf, req.bufused, rxbuf, rxlen);
+    }
+
+private:
+    soi2cContext_t &ctx;
+};
+
+} // namespace notecard
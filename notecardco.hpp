@@ -0,0 +1,500 @@
+// Copyright 2024 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// C++20 coroutine interface to Notecard transactions, built on the
+// non-blocking soi2cBegin/soi2cStep state machine.  The gaps between chunks
+// and polls become timers on a single-threaded executor rather than blocking
+// delays, so that one thread may drive many outstanding transactions, which
+// are queued to take their turns on each transport:
+//
+//  notecard::Task<> report(notecard::AsyncTransport &nc, jsonbContext &req)
+//  {
+//      int status = co_await nc.transact(req);
+//      ...
+//  }
+//
+//  notecard::Executor ex;
+//  notecard::AsyncTransport nc(ctx, ex);
+//  ex.spawn(report(nc, req));
+//  ex.run();
+//
+// Coroutines take their state as parameters, which are copied into their
+// frames, because the captures of a coroutine lambda die with the lambda.
+// By default the executor's clock is virtual, jumping to each timer as it
+// comes due, so that code using it can be tested without waiting.  To measure
+// transaction timeouts by the same clock, the context's micros method should
+// return the executor's now().
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#pragma once
+
+#if __cplusplus < 202002L
+#error "notecardco.hpp requires C++20"
+#endif
+
+#include "notecard.h"
+
+namespace notecard {
+
+template <typename T = void> class Task;
+class Executor;
+
+namespace detail {
+
+// Resumes the coroutine awaiting a task, if any, when the task finishes
+struct FinalAwaiter {
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        std::coroutine_handle<> next = h.promise().continuation;
+        return next ? next : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+};
+
+struct PromiseBase {
+    std::suspend_always initial_suspend() const noexcept
+    {
+        return {};
+    }
+    FinalAwaiter final_suspend() const noexcept
+    {
+        return {};
+    }
+    void unhandled_exception() const noexcept
+    {
+        std::terminate();
+    }
+    std::coroutine_handle<> continuation;
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    Task<T> get_return_object() noexcept;
+    void return_value(T v) noexcept
+    {
+        value = std::move(v);
+    }
+    T result() noexcept
+    {
+        return std::move(value);
+    }
+    T value {};
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void result() const noexcept {}
+};
+
+} // namespace detail
+
+// A coroutine yielding a T, which starts when it is first awaited or spawned
+template <typename T>
+class Task
+{
+public:
+    using promise_type = detail::Promise<T>;
+
+    Task(Task &&other) noexcept : h(std::exchange(other.h, {})) {}
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            if (h) {
+                h.destroy();
+            }
+            h = std::exchange(other.h, {});
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    bool done() const noexcept
+    {
+        return !h || h.done();
+    }
+
+    // Awaiting a task runs it until it finishes, and yields its result
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        h.promise().continuation = awaiting;
+        return h;
+    }
+    T await_resume() noexcept
+    {
+        return h.promise().result();
+    }
+
+private:
+    friend struct detail::Promise<T>;
+    friend class Executor;
+    explicit Task(std::coroutine_handle<promise_type> h) noexcept : h(h) {}
+
+    std::coroutine_handle<promise_type> h;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Runs coroutines on the calling thread, resuming each as its timer comes due
+class Executor
+{
+public:
+    using Timer = std::multimap<uint64_t, std::coroutine_handle<>>::iterator;
+
+    // With a virtual clock, time advances only when the executor has nothing
+    // to do before the next timer, and then jumps straight to it
+    explicit Executor(bool realTime = false) noexcept : realTime(realTime) {}
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    // Microseconds since the executor was created
+    uint64_t now() const noexcept
+    {
+        if (!realTime) {
+            return virtualUs;
+        }
+        return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Suspend the awaiting coroutine for a number of microseconds, optionally
+    // noting its timer so that it may be woken early
+    class Sleep
+    {
+    public:
+        bool await_ready() const noexcept
+        {
+            return us == 0;
+        }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            Timer t = ex.timers.emplace(ex.now() + us, h);
+            if (timer != nullptr) {
+                *timer = t;
+            }
+        }
+        void await_resume() const noexcept {}
+
+    private:
+        friend class Executor;
+        Sleep(Executor &ex, uint32_t us, Timer *timer) noexcept : ex(ex), us(us), timer(timer) {}
+
+        Executor &ex;
+        uint32_t us;
+        Timer *timer;
+    };
+    Sleep sleep(uint32_t us, Timer *timer = nullptr) noexcept
+    {
+        return Sleep(*this, us, timer);
+    }
+
+    // Resume a sleeping coroutine now rather than when its timer comes due,
+    // returning its new timer
+    Timer wake(Timer timer)
+    {
+        std::coroutine_handle<> h = timer->second;
+        timers.erase(timer);
+        return timers.emplace(now(), h);
+    }
+
+    // Resume a suspended coroutine as soon as the executor gets to it
+    Timer post(std::coroutine_handle<> h)
+    {
+        return timers.emplace(now(), h);
+    }
+
+    // Forget a timer, such as that of a coroutine being destroyed
+    void cancel(Timer timer)
+    {
+        timers.erase(timer);
+    }
+
+    // Have the executor's thread run a function as soon as it can, waking it
+    // from a wait for the next timer.  Unlike the rest of the executor, this
+    // may be called from any thread, though not from an interrupt handler.
+    void call(std::function<void()> fn)
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        inbox.push_back(std::move(fn));
+        inboxSignal.notify_one();
+    }
+
+    // Start a task, which the executor owns until it finishes
+    void spawn(Task<> task)
+    {
+        post(task.h);
+        tasks.push_back(std::move(task));
+    }
+
+    // Run the functions passed by call, then resume the coroutine whose timer
+    // is due first, waiting or advancing the clock until it is, returning false
+    // if nothing is left to run
+    bool runOnce()
+    {
+        std::vector<std::function<void()>> calls;
+        {
+            std::lock_guard<std::mutex> lock(inboxMutex);
+            calls.swap(inbox);
+        }
+        for (std::function<void()> &fn : calls) {
+            fn();
+        }
+        if (timers.empty()) {
+            return false;
+        }
+        Timer next = timers.begin();
+        uint64_t due = next->first;
+        if (!realTime) {
+            if (due > virtualUs) {
+                virtualUs = due;
+            }
+        } else {
+            // A function passed meanwhile by call is run before the timer
+            uint64_t t = now();
+            if (due > t) {
+                std::unique_lock<std::mutex> lock(inboxMutex);
+                bool called = inboxSignal.wait_for(lock, std::chrono::microseconds(due - t), [this] {
+                    return !inbox.empty();
+                });
+                if (called) {
+                    return true;
+                }
+            }
+        }
+        std::coroutine_handle<> h = next->second;
+        timers.erase(next);
+        h.resume();
+        return true;
+    }
+
+    // Run until every timer has fired, then release the finished tasks
+    void run()
+    {
+        while (runOnce()) {
+        }
+        std::erase_if(tasks, [](const Task<> &task) {
+            return task.done();
+        });
+    }
+
+private:
+    bool realTime;
+    uint64_t virtualUs = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::multimap<uint64_t, std::coroutine_handle<>> timers;
+    std::vector<Task<>> tasks;
+    std::mutex inboxMutex;
+    std::condition_variable inboxSignal;
+    std::vector<std::function<void()>> inbox;
+};
+
+// Transactions with a Notecard over a configured soi2c context, each awaited
+// as a coroutine.  A context handles one transaction at a time, so those
+// awaited concurrently on a transport are queued, and run in the order in
+// which they were first awaited.  Destroying a task before it finishes
+// withdraws its transaction, abandoning it with soi2cAbort if it has begun,
+// after which the Notecard may need a reset.
+class AsyncTransport
+{
+public:
+    AsyncTransport(soi2cContext_t &ctx, Executor &ex) noexcept : ctx(ctx), ex(ex) {}
+
+    AsyncTransport(const AsyncTransport &) = delete;
+    AsyncTransport &operator=(const AsyncTransport &) = delete;
+
+    soi2cContext_t &context() const noexcept
+    {
+        return ctx;
+    }
+
+    // As the corresponding soi2c transactions, whose buffers must remain valid
+    // until the task finishes
+    Task<int> transact(uint32_t flags, uint8_t *buf, uint32_t buflen)
+    {
+        return run(flags, soi2cSegment_t { nullptr, 0 }, buf, buflen);
+    }
+    Task<int> transact(uint32_t flags, const uint8_t *txbuf, uint32_t txlen, uint8_t *rxbuf, uint32_t rxlen)
+    {
+        return run(flags, soi2cSegment_t { txbuf, txlen }, rxbuf, rxlen);
+    }
+
+    // Send a request formatted into a jsonb context, whose buffer is reused
+    // for the response
+    Task<int> transact(jsonbContext &req)
+    {
+        return transact(0, req.buf, req.buflen);
+    }
+
+    // Send a request formatted into a jsonb context, receiving the response into
+    // a separate buffer so that the request may be sent again
+    Task<int> transact(const jsonbContext &req, uint8_t *rxbuf, uint32_t rxlen)
+    {
+        return transact(0, req.buf, req.bufused, rxbuf, rxlen);
+    }
+
+    // Signal that the peripheral is ready, such as from an ATTN pin event, so
+    // that a wait of the running transaction that may end early does so.  This
+    // may be called from any thread, as by Executor::call, and the transport
+    // must outlive the executor's handling of it.
+    void ready()
+    {
+        ex.call([this] {
+            if (active != nullptr && active->scheduled && active->untilReady) {
+                active->untilReady = false;
+                active->timer = ex.wake(active->timer);
+            }
+        });
+    }
+
+private:
+    // A transaction's turn on the context, which lives in its frame.  Awaiting
+    // it suspends the transaction behind those already queued unless the
+    // context is free.  It notes the transaction's timer while one is set, so
+    // that if the frame is destroyed early, the transaction can be withdrawn
+    // from the executor and the queue and the turn passed on.
+    class Turn
+    {
+    public:
+        explicit Turn(AsyncTransport &nc) noexcept : nc(nc) {}
+        ~Turn()
+        {
+            if (scheduled) {
+                nc.ex.cancel(timer);
+            }
+            if (nc.active == this) {
+                soi2cAbort(&nc.ctx);
+                nc.release();
+            } else {
+                std::erase(nc.queue, this);
+            }
+        }
+
+        Turn(const Turn &) = delete;
+        Turn &operator=(const Turn &) = delete;
+
+        bool await_ready() noexcept
+        {
+            if (nc.active != nullptr) {
+                return false;
+            }
+            nc.active = this;
+            return true;
+        }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            nc.queue.push_back(this);
+        }
+        void await_resume() noexcept
+        {
+            scheduled = false;
+        }
+
+        // Wait between steps, ending early once the peripheral is ready if
+        // untilReady is set
+        Executor::Sleep sleep(uint32_t us, bool untilReady) noexcept
+        {
+            this->untilReady = untilReady;
+            scheduled = true;
+            return nc.ex.sleep(us, &timer);
+        }
+        void awake() noexcept
+        {
+            untilReady = false;
+            scheduled = false;
+        }
+
+    private:
+        friend class AsyncTransport;
+
+        AsyncTransport &nc;
+        std::coroutine_handle<> handle;
+        Executor::Timer timer {};
+        bool scheduled = false;
+        bool untilReady = false;
+    };
+
+    // Pass the turn to the next queued transaction, if any
+    void release()
+    {
+        active = nullptr;
+        if (queue.empty()) {
+            return;
+        }
+        active = queue.front();
+        queue.pop_front();
+        active->timer = ex.post(active->handle);
+        active->scheduled = true;
+    }
+
+    // Begin a transaction once the task is first awaited and its turn comes,
+    // in place if there's no separate request segment, and step it until it
+    // completes.  The segment lives in the coroutine's frame, so that it
+    // outlasts the transaction.
+    Task<int> run(uint32_t flags, soi2cSegment_t seg, uint8_t *rxbuf, uint32_t rxlen)
+    {
+        Turn turn(*this);
+        co_await turn;
+        int status;
+        if (seg.buf == nullptr) {
+            status = soi2cBegin(&ctx, flags, rxbuf, rxlen);
+        } else {
+            status = soi2cBeginV(&ctx, flags, &seg, 1, rxbuf, rxlen);
+        }
+        while (status == STATUS_PENDING) {
+            uint32_t waitUs;
+            bool untilReady;
+            status = soi2cStep(&ctx, &waitUs, &untilReady);
+            if (status == STATUS_PENDING && waitUs != 0) {
+                co_await turn.sleep(waitUs, untilReady);
+                turn.awake();
+            }
+        }
+        release();
+        co_return status;
+    }
+
+    soi2cContext_t &ctx;
+    Executor &ex;
+    Turn *active = nullptr;
+    std::deque<Turn *> queue;
+};
+
+} // namespace notecard
@@ -4,6 +4,38 @@
 
 #include "soi2c.h"
 
+// Timings of the protocol as originally specified
+static const soi2cTiming_t soi2cDefaultTiming = SOI2C_TIMING_DEFAULTS;
+
+// States of a transaction in progress
+#define SOI2C_STATE_IDLE            0
+#define SOI2C_STATE_SEND            1
+#define SOI2C_STATE_REQUEST         2
+#define SOI2C_STATE_READ            3
+#define SOI2C_STATE_POLL            4
+#define SOI2C_STATE_DONE            5
+
+// Forwards
+static bool soi2cConfigured(soi2cContext_t *ctx);
+static bool soi2cTimingValid(const soi2cTiming_t *timing);
+static int soi2cRun(soi2cContext_t *ctx, int status);
+static void soi2cWait(soi2cContext_t *ctx, uint32_t us);
+static void soi2cStart(soi2cContext_t *ctx, uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint32_t reqlen, bool writable, uint8_t *rxbuf, uint32_t rxlen);
+static bool soi2cClockRead(soi2cContext_t *ctx, uint32_t *ticks);
+static uint64_t soi2cElapsedUs(soi2cContext_t *ctx);
+static bool soi2cExpired(soi2cContext_t *ctx);
+static uint32_t soi2cRequestLength(const uint8_t *buf, uint32_t buflen);
+static int soi2cStepSend(soi2cContext_t *ctx, uint32_t *waitUs);
+static int soi2cStepRequest(soi2cContext_t *ctx, uint32_t *waitUs);
+static int soi2cStepRead(soi2cContext_t *ctx, uint32_t *waitUs);
+static int soi2cStepPoll(soi2cContext_t *ctx, uint32_t *waitUs, bool *untilReady);
+static void soi2cGap(soi2cContext_t *ctx);
+static bool soi2cBackOff(soi2cContext_t *ctx);
+static uint16_t soi2cGapMin(soi2cContext_t *ctx);
+static uint16_t soi2cGapMax(soi2cContext_t *ctx);
+static uint32_t soi2cGapBegin(soi2cContext_t *ctx);
+static void soi2cGapRecord(soi2cContext_t *ctx, uint64_t us);
+
 // Reset the state4 of things by sending a \n to flush anything pending
 // on the i2c peripheral from before this host was reset.  This ensures that
 // our first transaction will be received cleanly.
@@ -14,6 +46,17 @@ int soi2cReset(soi2cContext_t *ctx)
     return soi2cTransaction(ctx, SOI2C_IGNORE_RESPONSE, resetReq, sizeof(resetReq));
 }
 
+// Set the protocol timings, which must remain valid while the context is in
+// use, or restore the defaults if timing is NULL
+int soi2cSetTiming(soi2cContext_t *ctx, const soi2cTiming_t *timing)
+{
+    if (timing != NULL && !soi2cTimingValid(timing)) {
+        return STATUS_CONFIG;
+    }
+    ctx->timing = timing;
+    return STATUS_OK;
+}
+
 // Get buffer info
 uint32_t soi2cBuf(soi2cContext_t *ctx, uint8_t **buf, uint32_t *buflen)
 {
@@ -32,137 +75,613 @@ uint32_t soi2cBuf(soi2cContext_t *ctx, uint8_t **buf, uint32_t *buflen)
 // buflen on input should be the current full allocated size of that buf.
 int soi2cTransaction(soi2cContext_t *ctx, uint32_t flags, uint8_t *buf, uint32_t buflen)
 {
+    if (ctx->delay == NULL) {
+        return STATUS_CONFIG;
+    }
+    return soi2cRun(ctx, soi2cBegin(ctx, flags, buf, buflen));
+}
+
+// Perform a transaction using separate buffers, leaving the request untouched so
+// that it may be retransmitted.  The request must be terminated with \n within
+// txlen bytes.  The response is received into rxbuf, which may be grown by
+// growFn, and may be retrieved with soi2cBuf.  If SOI2C_NO_RESPONSE is specified,
+// rxbuf may be NULL.
+int soi2cTransactionTxRx(soi2cContext_t *ctx, uint32_t flags, const uint8_t *txbuf, uint32_t txlen, uint8_t *rxbuf, uint32_t rxlen)
+{
+    soi2cSegment_t seg = { txbuf, txlen };
+    return soi2cTransactionV(ctx, flags, &seg, 1, rxbuf, rxlen);
+}
 
-    // Default i2c address to the notecard
-    if (ctx->addr == 0) {
-        ctx->addr = SOI2C_DEFAULT_I2C_ADDR;
+// Perform a transaction whose request is the concatenation of several segments,
+// such as a static prefix, an encoded body, and the \n, so that it needn't be
+// assembled into a single buffer.  The request ends at the first \n within the
+// segments, which are left untouched.  Otherwise as soi2cTransactionTxRx.
+int soi2cTransactionV(soi2cContext_t *ctx, uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint8_t *rxbuf, uint32_t rxlen)
+{
+    if (ctx->delay == NULL) {
+        return STATUS_CONFIG;
+    }
+    return soi2cRun(ctx, soi2cBeginV(ctx, flags, seg, segCount, rxbuf, rxlen));
+}
+
+// Begin a transaction as soi2cTransaction, without blocking.  This returns
+// STATUS_PENDING if the transaction has begun, after which soi2cStep must be
+// called until it completes, or STATUS_BUSY if one is already in progress on
+// the context.  The delay method is not used, and is optional.
+int soi2cBegin(soi2cContext_t *ctx, uint32_t flags, uint8_t *buf, uint32_t buflen)
+{
+
+    // Exit if a transaction is already in progress, leaving it undisturbed
+    if (ctx->op.state != SOI2C_STATE_IDLE) {
+        return STATUS_BUSY;
     }
 
     // Exit if not configured
-    if (ctx->tx == NULL || ctx->rx == NULL || ctx->delay == NULL || buflen < 5) {
+    if (!soi2cConfigured(ctx) || buflen < 5) {
         return STATUS_CONFIG;
     }
 
     // Exit if request isn't newline-terminated
-    ctx->buf = buf;
-    ctx->buflen = buflen;
-    ctx->bufused = 0;
-    for (int i=0; i<buflen; i++) {
-        ctx->bufused++;
-        if (buf[i] == '\n') {
-            break;
+    uint32_t reqlen = soi2cRequestLength(buf, buflen);
+    if (reqlen == 0) {
+        return STATUS_TERMINATOR;
+    }
+
+    // Unless the driver can send each chunk's header separately, shift the req
+    // in the buf once to allow space for the first header, so that the buf may
+    // be transmitted in place.
+    uint8_t *req = buf;
+    if (ctx->txHdr == NULL) {
+        if ((buflen - reqlen) < 1) {
+            return STATUS_TX_BUFFER_OVERFLOW;
         }
+        memmove(&buf[1], buf, reqlen);
+        req = &buf[1];
     }
-    if (ctx->bufused == 0) {
-        return STATUS_TERMINATOR;
+
+    // Once transmitted, receive into the txbuf, which is then free to be used
+    // as a (potentially-growing) rxbuf.
+    ctx->op.txSeg.buf = req;
+    ctx->op.txSeg.len = reqlen;
+    soi2cStart(ctx, flags, &ctx->op.txSeg, 1, reqlen, true, buf, buflen);
+    return STATUS_PENDING;
+
+}
+
+// Begin a transaction as soi2cTransactionV, without blocking.  The segments
+// and the array describing them must remain valid until it completes.
+// Otherwise as soi2cBegin.
+int soi2cBeginV(soi2cContext_t *ctx, uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint8_t *rxbuf, uint32_t rxlen)
+{
+
+    // Exit if a transaction is already in progress, leaving it undisturbed
+    if (ctx->op.state != SOI2C_STATE_IDLE) {
+        return STATUS_BUSY;
     }
 
-    // Begin by shifting the req in the buf to allow space for the transmit header
-    if ((ctx->buflen - ctx->bufused) < 1) {
-        return STATUS_TX_BUFFER_OVERFLOW;
+    // Exit if not configured
+    bool responseExpected = ((flags & SOI2C_NO_RESPONSE) == 0);
+    if (!soi2cConfigured(ctx) || (responseExpected && (rxbuf == NULL || rxlen < 5))) {
+        return STATUS_CONFIG;
     }
-    memmove(&ctx->buf[1], ctx->buf, ctx->bufused);
 
-    // Loop, transmitting at most 250 bytes per chunk every 250 milliseconds
-    uint32_t left = ctx->bufused;
-    while (left) {
+    // Exit if request isn't newline-terminated
+    uint32_t reqlen = 0;
+    bool terminated = false;
+    for (uint32_t i=0; i<segCount && !terminated; i++) {
+        uint32_t len = soi2cRequestLength(seg[i].buf, seg[i].len);
+        terminated = (len != 0);
+        reqlen += terminated ? len : seg[i].len;
+    }
+    if (!terminated) {
+        return STATUS_TERMINATOR;
+    }
 
-        uint8_t chunklen = 250;
-        if (left < chunklen) {
-            chunklen = (uint8_t) left;
+    // Transmit the request, which may not be modified
+    soi2cStart(ctx, flags, seg, segCount, reqlen, false, rxbuf, rxlen);
+    return STATUS_PENDING;
+
+}
+
+// Advance a transaction by at most one bus operation.  This returns the status
+// of the transaction once it has completed, or else STATUS_PENDING along with
+// the microseconds to wait before the next step.  If untilReady is set, the
+// wait may be cut short once the peripheral signals that it is ready.  Without
+// a delayUs method, waits are whole milliseconds.
+int soi2cStep(soi2cContext_t *ctx, uint32_t *waitUs, bool *untilReady)
+{
+    soi2cOp_t *op = &ctx->op;
+
+    // Once the least gap after a chunk has passed, wait out the rest of the gap
+    // unless the peripheral is ready sooner
+    uint32_t wait = 0;
+    bool ready = false;
+    int status;
+    uint64_t elapsedUs = soi2cElapsedUs(ctx);
+    if (op->gapRestUs != 0) {
+        wait = op->gapRestUs;
+        ready = true;
+        op->gapRestUs = 0;
+        status = STATUS_PENDING;
+    } else {
+
+        // Account for the time spent in the gap that preceded this step, if any
+        if (op->gapMs != 0) {
+            soi2cGapRecord(ctx, elapsedUs - op->gapStartUs);
+            op->gapMs = 0;
         }
 
-        ctx->buf[0] = chunklen;
-        if (!ctx->tx(ctx->port, ctx->addr, ctx->buf, 1+chunklen)) {
-            return STATUS_IO_TRANSMIT;
+        // Perform the operation at hand
+        switch (op->state) {
+        case SOI2C_STATE_SEND:
+            status = soi2cStepSend(ctx, &wait);
+            break;
+        case SOI2C_STATE_REQUEST:
+            status = soi2cStepRequest(ctx, &wait);
+            break;
+        case SOI2C_STATE_READ:
+            status = soi2cStepRead(ctx, &wait);
+            break;
+        case SOI2C_STATE_POLL:
+            status = soi2cStepPoll(ctx, &wait, &ready);
+            break;
+        case SOI2C_STATE_DONE:
+            status = STATUS_OK;
+            break;
+        default:
+            status = STATUS_CONFIG;
+            break;
+        }
+        if (status != STATUS_PENDING) {
+            op->state = SOI2C_STATE_IDLE;
+            return status;
         }
-        ctx->delay(250);
 
-        left -= chunklen;
-        memmove(&ctx->buf[1], &ctx->buf[1+chunklen], left);
+    }
 
+    // Round the wait to what the driver can delay, and without a clock, take
+    // it to have elapsed in full
+    if (ctx->delayUs == NULL) {
+        wait = ((wait + 999) / 1000) * 1000;
+    }
+    if (ctx->millis == NULL && ctx->micros == NULL) {
+        op->elapsedUs += wait;
     }
+    if (waitUs != NULL) {
+        *waitUs = wait;
+    }
+    if (untilReady != NULL) {
+        *untilReady = ready;
+    }
+    return STATUS_PENDING;
 
-    // Exit if a "cmd" was sent and no response is expected.
-    if ((flags & SOI2C_NO_RESPONSE) != 0) {
-        return STATUS_OK;
+}
+
+// Abandon the transaction in progress on a context, if any, so that another
+// may begin.  The peripheral may be left holding part of a request or a
+// response, which soi2cReset clears.
+void soi2cAbort(soi2cContext_t *ctx)
+{
+    ctx->op.state = SOI2C_STATE_IDLE;
+    ctx->op.gapMs = 0;
+    ctx->op.gapRestUs = 0;
+}
+
+// Default the address and verify that the required methods are present
+static bool soi2cConfigured(soi2cContext_t *ctx)
+{
+
+    // Default i2c address to the notecard
+    if (ctx->addr == 0) {
+        ctx->addr = SOI2C_DEFAULT_I2C_ADDR;
     }
 
-    // Go into a receive loop, using the txbuf as a (potentially-growing) rxbuf.
-    uint32_t msLeftToWait = 5000;
-    uint8_t chunklen = 0;
-    while (true) {
-        uint8_t hdrlen = 2;
+    // Use the default timings unless others have been supplied
+    if (ctx->timing == NULL) {
+        ctx->timing = &soi2cDefaultTiming;
+    } else if (!soi2cTimingValid(ctx->timing)) {
+        return false;
+    }
 
-        // First, attempt to grow the buffer to ensure we have enough
-        if (ctx->growFn != NULL) {
-            if (ctx->bufused + hdrlen + chunklen > ctx->buflen) {
-                ctx->growFn(&ctx->buf, &ctx->buflen, ctx->bufused + hdrlen + chunklen);
-            }
+    return (ctx->tx != NULL && ctx->rx != NULL);
+
+}
+
+// Verify that timings are within the bounds of the protocol
+static bool soi2cTimingValid(const soi2cTiming_t *timing)
+{
+    return (timing->chunkLen >= 1 && timing->chunkLen <= 250
+            && timing->pollMinUs >= 1 && timing->pollMaxMs >= 1 && timing->pollMaxMs <= 5000
+            && timing->pollMinUs <= timing->pollMaxMs * 1000UL);
+}
+
+// Run a transaction that has begun until it completes, waiting as each step
+// directs
+static int soi2cRun(soi2cContext_t *ctx, int status)
+{
+    while (status == STATUS_PENDING) {
+        uint32_t waitUs;
+        bool untilReady;
+        status = soi2cStep(ctx, &waitUs, &untilReady);
+        if (status != STATUS_PENDING || waitUs == 0) {
+            continue;
+        }
+        if (!untilReady || ctx->waitReady == NULL) {
+            soi2cWait(ctx, waitUs);
+            continue;
         }
 
-        // Constrain by our buffer size
-        if (ctx->bufused + hdrlen + chunklen > ctx->buflen) {
-            chunklen = (ctx->buflen - ctx->bufused) - hdrlen;
+        // If the peripheral didn't become ready, make sure that the full time
+        // has been waited, in case the driver returned early
+        uint64_t startUs = soi2cElapsedUs(ctx);
+        if (!ctx->waitReady(ctx->port, waitUs) && (ctx->millis != NULL || ctx->micros != NULL)) {
+            uint64_t waitedUs = soi2cElapsedUs(ctx) - startUs;
+            if (waitedUs < waitUs) {
+                soi2cWait(ctx, waitUs - (uint32_t) waitedUs);
+            }
         }
+    }
+    return status;
+}
 
-        // Issue special write transaction that is a 'read will come next' transaction
-        ctx->buf[ctx->bufused+0] = 0;
-        ctx->buf[ctx->bufused+1] = chunklen;
-        if (!ctx->tx(ctx->port, ctx->addr, &ctx->buf[ctx->bufused], hdrlen)) {
-            return STATUS_IO_TRANSMIT;
+// Delay for a number of microseconds, or whole milliseconds without delayUs
+static void soi2cWait(soi2cContext_t *ctx, uint32_t us)
+{
+    if (ctx->delayUs != NULL) {
+        ctx->delayUs(us);
+    } else {
+        ctx->delay((us + 999) / 1000);
+    }
+}
+
+// Set up the state of a transaction that has been validated, beginning with
+// the transmission of its request
+static void soi2cStart(soi2cContext_t *ctx, uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint32_t reqlen, bool writable, uint8_t *rxbuf, uint32_t rxlen)
+{
+    soi2cOp_t *op = &ctx->op;
+    op->state = SOI2C_STATE_SEND;
+    op->flags = flags;
+    op->seg = seg;
+    op->segCount = segCount;
+    op->segOffset = 0;
+    op->txLeft = reqlen;
+    op->writable = writable;
+    op->rxbuf = rxbuf;
+    op->rxlen = rxlen;
+    op->receiving = false;
+    op->gapMs = 0;
+    op->gapRestUs = 0;
+    op->elapsedUs = 0;
+    soi2cClockRead(ctx, &op->clockLast);
+}
+
+// Read the context's clock, if it has one
+static bool soi2cClockRead(soi2cContext_t *ctx, uint32_t *ticks)
+{
+    if (ctx->micros != NULL) {
+        *ticks = ctx->micros();
+        return true;
+    }
+    if (ctx->millis != NULL) {
+        *ticks = ctx->millis();
+        return true;
+    }
+    return false;
+}
+
+// Microseconds elapsed since the start of the transaction.  The clock is read
+// at every step, so the ticks between readings never wrap.
+static uint64_t soi2cElapsedUs(soi2cContext_t *ctx)
+{
+    uint32_t now;
+    if (soi2cClockRead(ctx, &now)) {
+        uint32_t ticks = now - ctx->op.clockLast;
+        ctx->op.clockLast = now;
+        ctx->op.elapsedUs += (ctx->micros != NULL) ? ticks : ticks * 1000ULL;
+    }
+    return ctx->op.elapsedUs;
+}
+
+// Whether the transaction has run past its limit
+static bool soi2cExpired(soi2cContext_t *ctx)
+{
+    return (ctx->timeoutMs != 0 && soi2cElapsedUs(ctx) >= ctx->timeoutMs * 1000ULL);
+}
+
+// Length of a request including its \n terminator, or 0 if it isn't terminated
+static uint32_t soi2cRequestLength(const uint8_t *buf, uint32_t buflen)
+{
+    if (buflen == 0) {
+        return 0;
+    }
+    const uint8_t *terminator = (const uint8_t *) memchr(buf, '\n', buflen);
+    if (terminator == NULL) {
+        return 0;
+    }
+    return (uint32_t) (terminator - buf) + 1;
+}
+
+// Transmit the next chunk of the request, at most timing->chunkLen bytes,
+// paced as described in soi2c.h.  Each chunk is preceded by a header byte holding
+// its length.  A chunk lying within a single segment is sent from where it lies
+// if the driver can send that header separately, or if the request is writable,
+// in which case the header is written into the byte preceding the chunk (which
+// is either spare or the already-transmitted end of the previous chunk).  Any
+// other chunk is gathered along with its header into a scratch chunk.
+static int soi2cStepSend(soi2cContext_t *ctx, uint32_t *waitUs)
+{
+    soi2cOp_t *op = &ctx->op;
+    if (soi2cExpired(ctx)) {
+        return STATUS_IO_TIMEOUT;
+    }
+
+    uint8_t chunklen = ctx->timing->chunkLen;
+    if (op->txLeft < chunklen) {
+        chunklen = (uint8_t) op->txLeft;
+    }
+
+    // Skip past exhausted segments
+    while (op->segOffset == op->seg->len && op->segCount > 1) {
+        op->seg++;
+        op->segCount--;
+        op->segOffset = 0;
+    }
+
+    // Find or assemble the chunk, along with its header if needed, leaving the
+    // position within the request unchanged until the chunk has been accepted
+    uint8_t scratch[1+250];
+    const soi2cSegment_t *seg = op->seg;
+    uint32_t segCount = op->segCount;
+    uint32_t segOffset = op->segOffset;
+    const uint8_t *chunk = &seg->buf[segOffset];
+    uint8_t *framed = NULL;
+    if (seg->len - segOffset >= chunklen && ctx->txHdr != NULL) {
+        segOffset += chunklen;
+    } else if (seg->len - segOffset >= chunklen && op->writable) {
+        framed = (uint8_t *) chunk - 1;
+        framed[0] = chunklen;
+        segOffset += chunklen;
+    } else {
+        framed = scratch;
+        scratch[0] = chunklen;
+        for (uint32_t gathered = 0; gathered < chunklen; ) {
+            while (segOffset == seg->len) {
+                seg++;
+                segCount--;
+                segOffset = 0;
+            }
+            uint32_t n = seg->len - segOffset;
+            if (n > chunklen - gathered) {
+                n = chunklen - gathered;
+            }
+            memcpy(&scratch[1+gathered], &seg->buf[segOffset], n);
+            gathered += n;
+            segOffset += n;
         }
-        ctx->delay(1);
+    }
 
-        // Receive the chunk of data
-        if (!ctx->rx(ctx->port, ctx->addr, &ctx->buf[ctx->bufused], chunklen + hdrlen)) {
+    // Transmit it, retrying after a longer gap if it is refused
+    bool success;
+    if (framed == NULL) {
+        success = ctx->txHdr(ctx->port, ctx->addr, chunklen, chunk, chunklen);
+    } else {
+        success = ctx->tx(ctx->port, ctx->addr, framed, 1+chunklen);
+    }
+    if (!success) {
+        if (!soi2cBackOff(ctx)) {
             return STATUS_IO_TRANSMIT;
         }
-        ctx->delay(5);
+        *waitUs = soi2cGapBegin(ctx);
+        ctx->stats.retries++;
+        return STATUS_PENDING;
+    }
+    op->seg = seg;
+    op->segCount = segCount;
+    op->segOffset = segOffset;
+    op->txLeft -= chunklen;
 
-        // Verify size
-        uint8_t availableBytes = ctx->buf[ctx->bufused+0];
-        uint8_t returnedBytes = ctx->buf[ctx->bufused+1];
-        if (returnedBytes != chunklen) {
-            return STATUS_IO_BAD_SIZE_RETURNED;
-        }
+    // Leave a gap after the chunk, which may end early once the peripheral is
+    // ready, but only after a floor that keeps a ready signal still asserted
+    // from before the chunk from letting the next one follow on its heels.
+    // Then move on to the response unless no response is expected.
+    soi2cGap(ctx);
+    uint32_t gapUs = soi2cGapBegin(ctx);
+    *waitUs = (ctx->timing->readyMinUs < gapUs) ? ctx->timing->readyMinUs : gapUs;
+    op->gapRestUs = gapUs - *waitUs;
+    if (op->txLeft == 0) {
+        op->state = ((op->flags & SOI2C_NO_RESPONSE) != 0) ? SOI2C_STATE_DONE : SOI2C_STATE_REQUEST;
+    }
+    return STATUS_PENDING;
+}
 
-        // Look at what has just been received for a terminator, and stop if found
-        bool receivedNewline = (memchr(&ctx->buf[ctx->bufused+2], '\n', chunklen) != NULL);
+// Set the gap to be left after an accepted chunk, and ease the gap to follow
+// the next one back toward the minimum
+static void soi2cGap(soi2cContext_t *ctx)
+{
+    uint16_t gapMin = soi2cGapMin(ctx);
+    if (ctx->chunkGapMs < gapMin || ctx->chunkGapMs > soi2cGapMax(ctx)) {
+        ctx->chunkGapMs = gapMin;
+    }
+    ctx->op.gapMs = ctx->chunkGapMs;
+    ctx->stats.chunks++;
+    ctx->chunkGapMs -= (ctx->chunkGapMs - gapMin + 1) / 2;
+}
 
-        // Only move bytes into the response buffer if a nonzero length specified,
-        // else just flush it.
-        if ((flags & SOI2C_IGNORE_RESPONSE) == 0 && chunklen > 0) {
-            memmove(&ctx->buf[ctx->bufused], &ctx->buf[ctx->bufused+2], chunklen);
-            ctx->bufused += chunklen;
-        }
+// After a refused chunk, set a doubled gap to be waited out before the retry,
+// returning false if the gap is already at its maximum
+static bool soi2cBackOff(soi2cContext_t *ctx)
+{
+    uint16_t gapMin = soi2cGapMin(ctx);
+    uint16_t gapMax = soi2cGapMax(ctx);
+    if (ctx->chunkGapMs < gapMin || ctx->chunkGapMs > gapMax) {
+        ctx->chunkGapMs = gapMin;
+    }
+    if (ctx->chunkGapMs >= gapMax) {
+        return false;
+    }
+    ctx->chunkGapMs = (ctx->chunkGapMs > gapMax/2) ? gapMax : ctx->chunkGapMs*2;
+    ctx->op.gapMs = ctx->chunkGapMs;
+    return true;
+}
 
-        // Attempt to receive all available bytes in the next chunk
-        chunklen = availableBytes;
+// Bounds of the inter-chunk gap
+static uint16_t soi2cGapMin(soi2cContext_t *ctx)
+{
+    return (ctx->chunkGapMinMs == 0) ? 250 : ctx->chunkGapMinMs;
+}
+static uint16_t soi2cGapMax(soi2cContext_t *ctx)
+{
+    uint16_t gapMin = soi2cGapMin(ctx);
+    return (ctx->chunkGapMaxMs < gapMin) ? gapMin : ctx->chunkGapMaxMs;
+}
 
-        // If more to receive, do it
-        if (chunklen > 0) {
-            continue;
+// Note the start of the gap that has been set, returning its length in
+// microseconds.  The time actually spent in it is recorded at the next step.
+static uint32_t soi2cGapBegin(soi2cContext_t *ctx)
+{
+    ctx->op.gapStartUs = soi2cElapsedUs(ctx);
+    return ctx->op.gapMs * 1000UL;
+}
+
+// Record the time spent in a gap in the statistics, saturating rather than
+// wrapping if a caller of soi2cStep left a very long time before stepping
+static void soi2cGapRecord(soi2cContext_t *ctx, uint64_t us)
+{
+    uint64_t ms64 = (us + 999) / 1000;
+    uint16_t ms = (ms64 > UINT16_MAX) ? UINT16_MAX : (uint16_t) ms64;
+    ctx->stats.gapMsTotal = (ctx->stats.gapMsTotal > UINT32_MAX - ms) ? UINT32_MAX : ctx->stats.gapMsTotal + ms;
+    if (ctx->stats.gaps == 0 || ms < ctx->stats.gapMsMin) {
+        ctx->stats.gapMsMin = ms;
+    }
+    if (ms > ctx->stats.gapMsMax) {
+        ctx->stats.gapMsMax = ms;
+    }
+    ctx->stats.gaps++;
+}
+
+// Issue the special write transaction that says a read will come next, for as
+// much of the response as is known to be available and will fit in the
+// context's (potentially-growing) buffer
+static int soi2cStepRequest(soi2cContext_t *ctx, uint32_t *waitUs)
+{
+    soi2cOp_t *op = &ctx->op;
+    uint8_t hdrlen = 2;
+
+    // Begin receiving into the response buffer, with a deadline for the response
+    if (!op->receiving) {
+        op->receiving = true;
+        ctx->buf = op->rxbuf;
+        ctx->buflen = op->rxlen;
+        ctx->bufused = 0;
+        uint32_t timeoutSecs = SOI2C_TIMEOUT_SECS(op->flags);
+        if (timeoutSecs == 0) {
+            timeoutSecs = SOI2C_DEFAULT_TIMEOUT_SECS;
+        }
+        op->deadlineUs = soi2cElapsedUs(ctx) + timeoutSecs * 1000000ULL;
+        if (ctx->timeoutMs != 0 && op->deadlineUs > ctx->timeoutMs * 1000ULL) {
+            op->deadlineUs = ctx->timeoutMs * 1000ULL;
         }
+        op->pollUs = ctx->timing->pollMinUs;
+        op->rxChunk = 0;
+    }
 
-        // If there's nothing available AND we've received a newline, we're done
-        if (receivedNewline) {
-            break;
+    // First, attempt to grow the buffer to ensure we have enough
+    uint8_t chunklen = op->rxChunk;
+    if (ctx->growFn != NULL) {
+        if (ctx->bufused + hdrlen + chunklen > ctx->buflen) {
+            ctx->growFn(&ctx->buf, &ctx->buflen, ctx->bufused + hdrlen + chunklen);
         }
+    }
 
-        // If no time left to process the transaction, give up
-        uint32_t pollMs = 50;
-        if (msLeftToWait < pollMs) {
-            return STATUS_IO_TIMEOUT;
+    // Constrain by our buffer size, failing if there's no room for any of
+    // what is available
+    if (ctx->bufused + hdrlen + chunklen > ctx->buflen) {
+        if (ctx->bufused + hdrlen >= ctx->buflen) {
+            return STATUS_RX_BUFFER_OVERFLOW;
         }
+        chunklen = (ctx->buflen - ctx->bufused) - hdrlen;
+    }
+    op->rxChunk = chunklen;
+
+    // Issue special write transaction that is a 'read will come next' transaction
+    ctx->buf[ctx->bufused+0] = 0;
+    ctx->buf[ctx->bufused+1] = chunklen;
+    if (!ctx->tx(ctx->port, ctx->addr, &ctx->buf[ctx->bufused], hdrlen)) {
+        return STATUS_IO_TRANSMIT;
+    }
+    *waitUs = ctx->timing->readSetupUs;
+    op->state = SOI2C_STATE_READ;
+    return STATUS_PENDING;
+}
 
-        // Delay, and subtract from what's left
-        ctx->delay(pollMs);
-        msLeftToWait -= pollMs;
+// Receive a chunk of the response
+static int soi2cStepRead(soi2cContext_t *ctx, uint32_t *waitUs)
+{
+    soi2cOp_t *op = &ctx->op;
+    uint8_t hdrlen = 2;
+    uint8_t chunklen = op->rxChunk;
 
+    // Receive the chunk of data
+    if (!ctx->rx(ctx->port, ctx->addr, &ctx->buf[ctx->bufused], chunklen + hdrlen)) {
+        return STATUS_IO_TRANSMIT;
     }
+    *waitUs = ctx->timing->readDoneUs;
 
-    // Done
-    return STATUS_OK;
+    // Verify size
+    uint8_t availableBytes = ctx->buf[ctx->bufused+0];
+    uint8_t returnedBytes = ctx->buf[ctx->bufused+1];
+    if (returnedBytes != chunklen) {
+        return STATUS_IO_BAD_SIZE_RETURNED;
+    }
+
+    // Look at what has just been received for a terminator, and stop if found
+    op->rxNewline = (memchr(&ctx->buf[ctx->bufused+2], '\n', chunklen) != NULL);
+
+    // Only move bytes into the response buffer if a nonzero length specified,
+    // else just flush it.
+    if ((op->flags & SOI2C_IGNORE_RESPONSE) == 0 && chunklen > 0) {
+        memmove(&ctx->buf[ctx->bufused], &ctx->buf[ctx->bufused+2], chunklen);
+        ctx->bufused += chunklen;
+    }
 
+    // Attempt to receive all available bytes in the next chunk
+    op->rxChunk = availableBytes;
+
+    // If more to receive, do it, polling quickly again once it's received
+    if (op->rxChunk > 0) {
+        op->pollUs = ctx->timing->pollMinUs;
+        op->state = SOI2C_STATE_REQUEST;
+        return STATUS_PENDING;
+    }
+
+    // If there's nothing available AND we've received a newline, we're done,
+    // else wait before polling again
+    op->state = op->rxNewline ? SOI2C_STATE_DONE : SOI2C_STATE_POLL;
+    return STATUS_PENDING;
+}
+
+// Wait before polling for more of the response, until the peripheral signals
+// that it is ready if it can, or else for an interval that backs off toward
+// the cap
+static int soi2cStepPoll(soi2cContext_t *ctx, uint32_t *waitUs, bool *untilReady)
+{
+    soi2cOp_t *op = &ctx->op;
+
+    // If no time left to process the transaction, give up
+    uint64_t elapsedUs = soi2cElapsedUs(ctx);
+    if (elapsedUs >= op->deadlineUs) {
+        return STATUS_IO_TIMEOUT;
+    }
+
+    // Wait, polling at the cap in case a ready signal is missed
+    uint32_t pollMaxUs = ctx->timing->pollMaxMs * 1000UL;
+    uint32_t wait = (ctx->waitReady != NULL) ? pollMaxUs : op->pollUs;
+    if (wait > op->deadlineUs - elapsedUs) {
+        wait = (uint32_t) (op->deadlineUs - elapsedUs);
+    }
+    op->pollUs = (op->pollUs > pollMaxUs/2) ? pollMaxUs : op->pollUs*2;
+    *waitUs = wait;
+    *untilReady = true;
+    op->state = SOI2C_STATE_REQUEST;
+    return STATUS_PENDING;
 }
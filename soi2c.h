@@ -8,6 +8,10 @@
 
 #pragma once
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define SOI2C_DEFAULT_I2C_ADDR      0x17        // Notecard
 
 #define STATUS_OK                    0
@@ -19,33 +23,147 @@
 #define STATUS_IO_RECEIVE            6
 #define STATUS_IO_TIMEOUT            7
 #define STATUS_IO_BAD_SIZE_RETURNED  8
+#define STATUS_PENDING               9
+#define STATUS_BUSY                 10
 typedef int soi2cStatus_t;
 
 typedef bool (*i2cTransmitFn) (void *port, uint16_t devAddr, uint8_t *buf, uint16_t buflen);
+typedef bool (*i2cTransmitHdrFn) (void *port, uint16_t devAddr, uint8_t hdr, const uint8_t *buf, uint16_t buflen);
 typedef bool (*i2cReceiveFn) (void *port, uint16_t devAddr, uint8_t *buf, uint16_t buflen);
 typedef void (*i2cDelayFn) (uint32_t ms);
+typedef void (*i2cDelayUsFn) (uint32_t us);
+typedef uint32_t (*i2cClockFn) (void);
+typedef bool (*i2cWaitReadyFn) (void *port, uint32_t timeoutUs);
 typedef bool (*i2cBufGrowFn) (uint8_t **buf, uint32_t *buflen, uint32_t neededBytes);
+
+// Statistics on the gaps left after transmitted chunks, accumulated across
+// transactions until cleared by the caller
+typedef struct {
+    uint32_t chunks;            // Chunks accepted by the peripheral
+    uint32_t retries;           // Chunks retransmitted after being refused
+    uint32_t gaps;              // Gaps recorded below
+    uint32_t gapMsTotal;        // Total time spent in gaps
+    uint16_t gapMsMin;          // Shortest and longest gap used
+    uint16_t gapMsMax;
+} soi2cStats_t;
+
+// Protocol timings, which fast hosts and bus drivers may tighten.  Delays of
+// less than a millisecond require a delayUs method.
+typedef struct {
+    uint8_t chunkLen;           // Maximum bytes per transmitted chunk, 1..250
+    uint16_t readSetupUs;       // After requesting a read, before reading
+    uint16_t readDoneUs;        // After each read
+    uint16_t pollMinUs;         // First interval between reads awaiting a response,
+    uint16_t pollMaxMs;         // doubling up to this cap of 1..5000
+    uint16_t readyMinUs;        // After each chunk, before waitReady may end the gap
+} soi2cTiming_t;
+#define SOI2C_TIMING_DEFAULTS       { 250, 1000, 5000, 500, 50, 5000 }
+
+// A segment of a request to be transmitted by soi2cTransactionV
+typedef struct {
+    const uint8_t *buf;
+    uint32_t len;
+} soi2cSegment_t;
+
+// State of the transaction in progress on a context, private to soi2c.c.  A
+// context runs one transaction at a time, so beginning another before
+// soi2cStep has returned the status of the last one, or before it has been
+// abandoned with soi2cAbort, fails with STATUS_BUSY.
+typedef struct {
+    uint8_t state;
+    bool writable;
+    bool receiving;
+    bool rxNewline;
+    uint8_t rxChunk;
+    uint16_t gapMs;
+    uint32_t flags;
+    soi2cSegment_t txSeg;
+    const soi2cSegment_t *seg;
+    uint32_t segCount;
+    uint32_t segOffset;
+    uint32_t txLeft;
+    uint8_t *rxbuf;
+    uint32_t rxlen;
+    uint32_t pollUs;
+    uint32_t gapRestUs;
+    uint32_t clockLast;
+    uint64_t elapsedUs;
+    uint64_t gapStartUs;
+    uint64_t deadlineUs;
+} soi2cOp_t;
+
+// A context must be zero-initialized before its fields are set, so that the
+// optional methods are absent and no transaction is in progress
 typedef struct {
     void *port;
     uint16_t addr;
     i2cTransmitFn tx;
     i2cReceiveFn rx;
+    // Required by the blocking transactions, but not by soi2cBegin and soi2cStep
     i2cDelayFn delay;
+    // Optionally, a delay with microsecond resolution
+    i2cDelayUsFn delayUs;
+    // Optionally, a free-running clock in milliseconds or microseconds by which
+    // timeouts are measured.  Without one, time is estimated by summing delays,
+    // which ignores the time spent within tx and rx.
+    i2cClockFn millis;
+    i2cClockFn micros;
+    // Optionally, a method that waits up to timeoutUs for the peripheral to
+    // signal that it is ready, such as by its ATTN pin, returning true as soon
+    // as it does, or false once the full timeout has passed.  If supplied, it
+    // ends the gap after each accepted chunk (once the readyMinUs timing has
+    // passed) and the delay between polls for the response, once the
+    // peripheral is ready.  Given a clock, a wait that returns false early is
+    // made up to its full length.
+    i2cWaitReadyFn waitReady;
     i2cBufGrowFn grow;
     // If growFn is supplied, the caller can retrieve the pointer and size of
     // the grown buffer directly from these fields.
     i2cBufGrowFn growFn;
+    // Optionally, a transmit method that sends a header byte followed by a
+    // buffer as a single write, so that chunks can be sent in place
+    i2cTransmitHdrFn txHdr;
+    // Pacing of transmitted chunks.  The gap after each chunk starts at
+    // chunkGapMinMs (250 if zero).  If a chunk is refused and the gap is below
+    // chunkGapMaxMs, the gap is doubled and the chunk retried, else the
+    // transaction fails; the gap then eases back toward the minimum as chunks
+    // are accepted.  chunkGapMs holds the current gap between transactions.
+    uint16_t chunkGapMinMs;
+    uint16_t chunkGapMaxMs;
+    uint16_t chunkGapMs;
+    // Protocol timings, or NULL for SOI2C_TIMING_DEFAULTS.  Set by soi2cSetTiming.
+    const soi2cTiming_t *timing;
+    // Limit on the duration of each entire transaction, or 0 for none.  This
+    // applies in addition to the limit on waiting for the response.
+    uint32_t timeoutMs;
+    soi2cStats_t stats;
     uint8_t *buf;
     uint32_t buflen;
     uint32_t bufused;
+    soi2cOp_t op;
 } soi2cContext_t;
 
 #define SOI2C_NO_RESPONSE           0x0001
 #define SOI2C_IGNORE_RESPONSE       0x0002
+// The upper half of the flags may hold the seconds to wait for a response, for
+// requests such as hub.sync that may take longer than the default
+#define SOI2C_DEFAULT_TIMEOUT_SECS  5
+#define SOI2C_TIMEOUT(secs)         (((uint32_t) (secs) & 0xffff) << 16)
+#define SOI2C_TIMEOUT_SECS(flags)   ((flags) >> 16)
 int soi2cTransaction(soi2cContext_t *ctx, uint32_t flags, uint8_t *buf, uint32_t buflen);
+int soi2cTransactionTxRx(soi2cContext_t *ctx, uint32_t flags, const uint8_t *txbuf, uint32_t txlen, uint8_t *rxbuf, uint32_t rxlen);
+int soi2cTransactionV(soi2cContext_t *ctx, uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint8_t *rxbuf, uint32_t rxlen);
 #define soi2cRequestResponse(ctx, buf, buflen) soi2cTransaction(ctx, 0, buf, buflen)
 #define soi2cRequest(ctx, buf, buflen) soi2cTransaction(ctx, SOI2C_IGNORE_RESPONSE, buf, buflen)
 #define soi2cCommand(ctx, buf, buflen) soi2cTransaction(ctx, SOI2C_NO_RESPONSE, buf, buflen)
+int soi2cBegin(soi2cContext_t *ctx, uint32_t flags, uint8_t *buf, uint32_t buflen);
+int soi2cBeginV(soi2cContext_t *ctx, uint32_t flags, const soi2cSegment_t *seg, uint32_t segCount, uint8_t *rxbuf, uint32_t rxlen);
+int soi2cStep(soi2cContext_t *ctx, uint32_t *waitUs, bool *untilReady);
+void soi2cAbort(soi2cContext_t *ctx);
 int soi2cReset(soi2cContext_t *ctx);
+int soi2cSetTiming(soi2cContext_t *ctx, const soi2cTiming_t *timing);
 uint32_t soi2cBuf(soi2cContext_t *ctx, uint8_t **buf, uint32_t *buflen);
 
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,198 @@
+// Copyright 2024 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Host benchmark of formatting and parsing a typical request, used by
+// jsonbsize.sh to compare build configurations.  Only types that are present
+// in every configuration are used.
+//
+// Given the argument "binz", it instead reports, for a few kinds of payload,
+// how much JSONB_BINZ compresses them, what that costs to encode and decode,
+// and how many I2C chunks the request takes with and without it.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../jsonb.h"
+
+#define ITERATIONS 200000
+
+static double nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static uint32_t format(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, int32_t i)
+{
+    jsonbObjectBegin(ctx, buf, buflen, NULL);
+    jsonbAddStringToObject(ctx, "req", "note.add");
+    jsonbAddStringToObject(ctx, "file", "sensors.qo");
+    jsonbAddTrueToObject(ctx, "sync");
+    jsonbAddItemToObject(ctx, "body");
+    jsonbAddObjectBegin(ctx);
+    jsonbAddInt32ToObject(ctx, "count", i);
+    jsonbAddUint16ToObject(ctx, "millivolts", 3300);
+    jsonbAddStringToObject(ctx, "status", "ok");
+    jsonbAddObjectEnd(ctx);
+    return jsonbObjectEnd(ctx);
+}
+
+#ifndef JSONB_CONFIG_NO_BINZ
+#define BINZ_ITERATIONS 2000
+#define BINZ_PAYLOAD 4096
+#define BINZ_CHUNK 250
+
+// Fill a payload of one of the kinds being measured
+static void binzPayload(int kind, uint8_t *p, uint32_t len)
+{
+    uint32_t seed = 12345;
+    uint32_t used = 0;
+    while (used < len) {
+        seed = seed * 1103515245u + 12345u;
+        uint8_t piece[64];
+        uint32_t n;
+        switch (kind) {
+        case 0:
+            // Text log lines, whose readings wander
+            n = (uint32_t) snprintf((char *) piece, sizeof(piece), "t=%u,temp=%u.%02u,hum=%u.%u\n",
+                                    1700000000u + used/4, 20 + (seed >> 28), (seed >> 8) % 100, 40 + (seed >> 29), (seed >> 4) % 10);
+            break;
+        case 1: {
+            // Little-endian 16-bit samples of a slowly drifting reading, which
+            // sometimes flickers by one count
+            uint32_t i = used / 2;
+            int16_t v = (int16_t) (2150 + (i / 32) % 16 + ((seed >> 29) == 0));
+            memcpy(piece, &v, sizeof(v));
+            n = sizeof(v);
+            break;
+        }
+        default:
+            // Incompressible bytes
+            piece[0] = (uint8_t) (seed >> 24);
+            n = 1;
+            break;
+        }
+        if (n > len - used) {
+            n = len - used;
+        }
+        memcpy(&p[used], piece, n);
+        used += n;
+    }
+}
+
+// Format a request carrying a payload, compressed or not, returning its length
+static uint32_t binzFormat(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, uint8_t *bin, uint32_t binLen, bool compress)
+{
+    jsonbObjectBegin(ctx, buf, buflen, NULL);
+    jsonbAddStringToObject(ctx, "req", "note.add");
+    if (compress) {
+        jsonbAddBinCompressedToObject(ctx, "payload", bin, binLen);
+    } else {
+        jsonbAddBinToObject(ctx, "payload", bin, binLen);
+    }
+    return jsonbObjectEnd(ctx);
+}
+
+static int benchBinz(void)
+{
+    static const char *kinds[] = { "text log", "samples", "random" };
+    static uint8_t bin[BINZ_PAYLOAD];
+    static uint8_t out[BINZ_PAYLOAD];
+    static uint8_t buf[2*BINZ_PAYLOAD];
+    static uint8_t frame[2*BINZ_PAYLOAD];
+    jsonbContext ctx;
+    volatile uint32_t sink = 0;
+
+    printf("%-10s %6s %6s %6s %10s %10s %7s %7s\n", "payload", "bytes", "binz", "ratio", "enc MB/s", "dec MB/s", "chunks", "binz");
+    for (int kind=0; kind<3; kind++) {
+        binzPayload(kind, bin, sizeof(bin));
+        uint32_t plainLen = binzFormat(&ctx, buf, sizeof(buf), bin, sizeof(bin), false);
+
+        // Encoding, of which compression is nearly all the cost
+        uint32_t len = 0;
+        double begin = nowNs();
+        for (int i=0; i<BINZ_ITERATIONS; i++) {
+            len = binzFormat(&ctx, frame, sizeof(frame), bin, sizeof(bin), true);
+            sink += len;
+        }
+        double encodeNs = (nowNs() - begin) / BINZ_ITERATIONS;
+
+        // Decoding the payload of the parsed request
+        uint8_t type;
+        void *v;
+        jsonbContext rsp;
+        memcpy(buf, frame, len);
+        if (!jsonbParse(&rsp, buf, len) || !jsonbGetObjectItem(&rsp, "payload", &type, &v)) {
+            return 1;
+        }
+        uint32_t vlen = rsp.vlen;
+        uint32_t binzLen = (type == JSONB_BINZ) ? vlen : sizeof(bin);
+        begin = nowNs();
+        for (int i=0; i<BINZ_ITERATIONS && type == JSONB_BINZ; i++) {
+            jsonbBinzReader r;
+            jsonbBinzBegin(&r, v, vlen, NULL);
+            uint32_t got = 0;
+            uint32_t n;
+            while ((n = jsonbBinzRead(&r, &out[got], sizeof(out) - got)) != 0) {
+                got += n;
+            }
+            sink += got;
+        }
+        double decodeNs = (nowNs() - begin) / BINZ_ITERATIONS;
+        if (type == JSONB_BINZ && memcmp(out, bin, sizeof(bin)) != 0) {
+            return 1;
+        }
+
+        // Throughput is of uncompressed bytes, and payloads left uncompressed
+        // have no decoding to measure
+        char decode[16] = "-";
+        if (type == JSONB_BINZ) {
+            snprintf(decode, sizeof(decode), "%.1f", sizeof(bin) * 1e3 / decodeNs);
+        }
+        printf("%-10s %6u %6u %6.2f %10.1f %10s %7u %7u\n", kinds[kind], (unsigned) sizeof(bin), (unsigned) binzLen,
+               (double) sizeof(bin) / binzLen, sizeof(bin) * 1e3 / encodeNs, decode,
+               (unsigned) ((plainLen + BINZ_CHUNK-1) / BINZ_CHUNK), (unsigned) ((len + BINZ_CHUNK-1) / BINZ_CHUNK));
+    }
+    return (sink == 0) ? 1 : 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "binz") == 0) {
+#ifndef JSONB_CONFIG_NO_BINZ
+        return benchBinz();
+#else
+        fprintf(stderr, "JSONB_BINZ is disabled by JSONB_CONFIG_NO_BINZ\n");
+        return 1;
+#endif
+    }
+
+    uint8_t buf[256];
+    uint8_t frame[256];
+    jsonbContext ctx;
+    volatile int32_t sink = 0;
+
+    // Formatting
+    double begin = nowNs();
+    for (int32_t i=0; i<ITERATIONS; i++) {
+        sink += (int32_t) format(&ctx, buf, sizeof(buf), i);
+    }
+    double formatNs = (nowNs() - begin) / ITERATIONS;
+
+    // Parsing, which decodes the frame in place and so works on a fresh copy
+    uint32_t len = format(&ctx, frame, sizeof(frame), 42);
+    begin = nowNs();
+    for (int32_t i=0; i<ITERATIONS; i++) {
+        memcpy(buf, frame, len);
+        jsonbContext rsp;
+        jsonbParse(&rsp, buf, len);
+        sink += jsonbGetInt32(&rsp, "count") + (int32_t) strlen(jsonbGetString(&rsp, "file"));
+    }
+    double parseNs = (nowNs() - begin) / ITERATIONS;
+
+    printf("%8.1f %8.1f\n", formatNs, parseNs);
+    return (sink == 0) ? 1 : 0;
+}
@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+# Copyright 2024 Blues Inc.  All rights reserved.
+# Use of this source code is governed by licenses granted by the
+# copyright holder including that found in the LICENSE file.
+
+"""Generate C encode/decode functions for Notecard requests on top of jsonb.h.
+
+The schema is a JSON file of the form:
+
+    {
+        "prefix": "nc",
+        "requests": [
+            {
+                "req": "card.version",
+                "request": {},
+                "response": {"version": "string:64", "device": "string:32"}
+            },
+            ...
+        ]
+    }
+
+Field types are int8, int16, int32, int64, uint8, uint16, uint32, uint64,
+float, double, bool and string:N (a char array of N bytes including the
+terminator).  Arrays and nested objects are not supported, so fields of those
+kinds must be left out of the schema.  Every request field is always sent.
+
+For each request this emits a request and a response struct, an Encode
+function that formats the request with a call per field for its own opcode
+and an item name of precomputed length, a jsonbFieldDesc table for the
+response, and a Decode function that fills the response in one pass,
+dispatching each item name through a perfect hash computed here from the
+response's field names.  The header also carries inline C++ overloads of
+encode() and decode().
+
+Usage: jsonbgen.py schema.json -o notecard_api
+"""
+
+import argparse
+import json
+import os
+import re
+import sys
+
+TYPES = {
+    "int8": ("int8_t", "JSONB_INT8", "jsonbAddInt8"),
+    "int16": ("int16_t", "JSONB_INT16", "jsonbAddInt16"),
+    "int32": ("int32_t", "JSONB_INT32", "jsonbAddInt32"),
+    "int64": ("int64_t", "JSONB_INT64", "jsonbAddInt64"),
+    "uint8": ("uint8_t", "JSONB_UINT8", "jsonbAddUint8"),
+    "uint16": ("uint16_t", "JSONB_UINT16", "jsonbAddUint16"),
+    "uint32": ("uint32_t", "JSONB_UINT32", "jsonbAddUint32"),
+    "uint64": ("uint64_t", "JSONB_UINT64", "jsonbAddUint64"),
+    "float": ("float", "JSONB_FLOAT", "jsonbAddFloat"),
+    "double": ("double", "JSONB_DOUBLE", "jsonbAddDouble"),
+    "bool": ("bool", "JSONB_TRUE", "jsonbAddBool"),
+}
+
+
+class Field:
+    def __init__(self, name, spec):
+        self.name = name
+        self.member = identifier(name)
+        self.size = None
+        m = re.fullmatch(r"string:(\d+)", spec)
+        if m:
+            self.ctype, self.opcode, self.adder = "char", "JSONB_STRING", "jsonbAddString"
+            self.size = int(m.group(1))
+            if self.size < 1:
+                raise ValueError("string field '%s' must have room for its terminator" % name)
+        elif spec in TYPES:
+            self.ctype, self.opcode, self.adder = TYPES[spec]
+        else:
+            raise ValueError("field '%s' has unknown type '%s'" % (name, spec))
+        if len(name.encode()) == 0 or len(name.encode()) > 255:
+            raise ValueError("field name '%s' must be 1..255 bytes" % name)
+
+    def declaration(self):
+        if self.size is not None:
+            return "%s %s[%d];" % (self.ctype, self.member, self.size)
+        return "%s %s;" % (self.ctype, self.member)
+
+
+def identifier(name):
+    ident = re.sub(r"[^0-9A-Za-z_]", "_", name)
+    if ident[0].isdigit():
+        ident = "_" + ident
+    return ident
+
+
+def camel(name):
+    return "".join(part[:1].upper() + part[1:] for part in re.split(r"[^0-9A-Za-z]+", name) if part)
+
+
+def c_string(s):
+    return '"' + s.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+def perfect_hash(names):
+    """Find (a, b, m) such that (len*a + first*b + last) % m is distinct for all
+    names, preferring the smallest table."""
+    keys = [(len(n), n[0], n[-1]) for n in (name.encode() for name in names)]
+    for m in range(max(1, len(keys)), 4 * len(keys) + 64):
+        for a in range(0, 32):
+            for b in range(1, 32):
+                seen = set()
+                for (length, first, last) in keys:
+                    h = (length * a + first * b + last) % m
+                    if h in seen:
+                        break
+                    seen.add(h)
+                else:
+                    return a, b, m
+    raise ValueError("no perfect hash found for %s" % names)
+
+
+def emit_struct(out, typename, fields):
+    out.append("typedef struct {")
+    if not fields:
+        out.append("    uint8_t unused;")
+    for f in fields:
+        out.append("    " + f.declaration())
+    out.append("} %s;" % typename)
+
+
+def emit_desc(out, typename, fields):
+    if not fields:
+        return
+    out.append("static const jsonbFieldDesc %sDesc[] = {" % typename)
+    for f in fields:
+        out.append("    JSONB_FIELD(%s, %s, %s, %s)," % (typename, f.member, c_string(f.name), f.opcode))
+    out.append("    JSONB_FIELD_END")
+    out.append("};")
+
+
+def generate(schema, base):
+    prefix = schema.get("prefix", "nc")
+    header, source = [], []
+    guard = os.path.basename(base)
+    header += [
+        "// Generated by jsonbgen.py from a Notecard API schema.  Do not edit.",
+        "",
+        "#include \"jsonb.h\"",
+        "",
+        "#pragma once",
+        "",
+        "#ifdef __cplusplus",
+        "extern \"C\" {",
+        "#endif",
+        "",
+    ]
+    source += [
+        "// Generated by jsonbgen.py from a Notecard API schema.  Do not edit.",
+        "",
+        "#include \"%s.h\"" % guard,
+        "",
+    ]
+    cpp = []
+
+    for entry in schema["requests"]:
+        req = entry["req"]
+        name = prefix + camel(req)
+        reqFields = [Field(k, v) for k, v in entry.get("request", {}).items()]
+        rspFields = [Field(k, v) for k, v in entry.get("response", {}).items()]
+        reqType, rspType = name + "Req", name + "Rsp"
+
+        # Types and prototypes
+        header.append("// %s" % req)
+        emit_struct(header, reqType, reqFields)
+        emit_struct(header, rspType, rspFields)
+        header.append("uint32_t %sEncode(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow, const %s *req);" % (name, reqType))
+        header.append("uint32_t %sDecode(jsonbContext *ctx, %s *rsp);" % (name, rspType))
+        header.append("")
+        cpp.append("inline uint32_t encode(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow, const %s &req)" % reqType)
+        cpp.append("{")
+        cpp.append("    return %sEncode(ctx, buf, buflen, bufGrow, &req);" % name)
+        cpp.append("}")
+        cpp.append("inline uint32_t decode(jsonbContext *ctx, %s &rsp)" % rspType)
+        cpp.append("{")
+        cpp.append("    return %sDecode(ctx, &rsp);" % name)
+        cpp.append("}")
+
+        # Descriptor table for the decoder
+        emit_desc(source, rspType, rspFields)
+        source.append("")
+
+        # Encoder
+        source.append("// Format a %s request, returning the length of the encoded request" % req)
+        source.append("uint32_t %sEncode(jsonbContext *ctx, uint8_t *buf, uint32_t buflen, bufGrowFn bufGrow, const %s *req)" % (name, reqType))
+        source.append("{")
+        source.append("    jsonbObjectBegin(ctx, buf, buflen, bufGrow);")
+        source.append("    jsonbAddItemWithLenToObject(ctx, \"req\", 3);")
+        source.append("    jsonbAddStringLen(ctx, %s, %d);" % (c_string(req), len(req.encode())))
+        for f in reqFields:
+            source.append("    jsonbAddItemWithLenToObject(ctx, %s, %d);" % (c_string(f.name), len(f.name.encode())))
+            source.append("    %s(ctx, req->%s);" % (f.adder, f.member))
+        if not reqFields:
+            source.append("    (void) req;")
+        source.append("    return jsonbObjectEnd(ctx);")
+        source.append("}")
+        source.append("")
+
+        # Decoder
+        source.append("// Decode a %s response in a single pass, returning the number of fields found" % req)
+        source.append("uint32_t %sDecode(jsonbContext *ctx, %s *rsp)" % (name, rspType))
+        source.append("{")
+        if not rspFields:
+            source.append("    (void) ctx;")
+            source.append("    (void) rsp;")
+            source.append("    return 0;")
+            source.append("}")
+            source.append("")
+            continue
+        a, b, m = perfect_hash([f.name for f in rspFields])
+        source.append("    uint8_t type;")
+        source.append("    const char *key;")
+        source.append("    void *value;")
+        source.append("    uint32_t found = 0;")
+        source.append("    jsonbEnum(ctx);")
+        source.append("    if (!jsonbEnumNext(ctx, NULL, &type, &key, &value) || type != JSONB_BEGIN_OBJECT) {")
+        source.append("        return 0;")
+        source.append("    }")
+        source.append("    while (jsonbEnumNext(ctx, NULL, &type, &key, &value)) {")
+        source.append("        if (key == NULL && type == JSONB_END_OBJECT) {")
+        source.append("            break;")
+        source.append("        }")
+        source.append("        if (key != NULL && ctx->klen > 0) {")
+        source.append("            const jsonbFieldDesc *d = NULL;")
+        terms = ["(uint8_t) key[0] * %du" % b, "(uint8_t) key[ctx->klen-1]"]
+        if a != 0:
+            terms.insert(0, "ctx->klen * %du" % a)
+        source.append("            switch ((%s) %% %du) {" % (" + ".join(terms), m))
+        cases = {}
+        for i, f in enumerate(rspFields):
+            n = f.name.encode()
+            cases[(len(n) * a + n[0] * b + n[-1]) % m] = (i, f)
+        for h in sorted(cases):
+            i, f = cases[h]
+            source.append("            case %d:" % h)
+            source.append("                d = &%sDesc[%d];" % (rspType, i))
+            source.append("                break;")
+        source.append("            }")
+        source.append("            if (d != NULL && d->nameLen == ctx->klen && memcmp(d->name, key, ctx->klen) == 0) {")
+        source.append("                jsonbDecodeField(ctx, d, rsp, type, value);")
+        source.append("                found++;")
+        source.append("            }")
+        source.append("        }")
+        source.append("        if (!jsonbEnumSkip(ctx)) {")
+        source.append("            break;")
+        source.append("        }")
+        source.append("    }")
+        source.append("    return found;")
+        source.append("}")
+        source.append("")
+
+    header += ["#ifdef __cplusplus", "}", ""]
+    header += ["namespace %s {" % prefix, ""]
+    header += cpp
+    header += ["", "} // namespace %s" % prefix, "#endif", ""]
+    return "\n".join(header), "\n".join(source)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate jsonb encoders and decoders from a Notecard API schema")
+    parser.add_argument("schema", help="JSON schema describing requests and responses")
+    parser.add_argument("-o", "--output", required=True, help="output path, without extension, for the .h and .c files")
+    args = parser.parse_args()
+    with open(args.schema) as f:
+        schema = json.load(f)
+    try:
+        header, source = generate(schema, args.output)
+    except ValueError as e:
+        sys.exit("jsonbgen: %s" % e)
+    with open(args.output + ".h", "w") as f:
+        f.write(header)
+    with open(args.output + ".c", "w") as f:
+        f.write(source)
+
+
+if __name__ == "__main__":
+    main()
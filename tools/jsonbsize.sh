@@ -0,0 +1,49 @@
+#!/bin/sh
+# Copyright 2024 Blues Inc.  All rights reserved.
+# Use of this source code is governed by licenses granted by the
+# copyright holder including that found in the LICENSE file.
+#
+# Report the code size of jsonb.c, and the host speed of formatting and parsing
+# a typical request, under each JSONB_CONFIG_* build configuration.
+#
+# Usage: tools/jsonbsize.sh [cc [cflags]]
+#   e.g. tools/jsonbsize.sh arm-none-eabi-gcc "-mcpu=cortex-m0plus -mthumb"
+# Sizes are measured with the given compiler at -Os.  Speeds are only measured
+# when it is the host compiler, with the host's cc at -O2.
+
+set -e
+cd "$(dirname "$0")/.."
+CC="${1:-cc}"
+CFLAGS="${2:-}"
+SIZE="$(echo "$CC" | sed 's/gcc$/size/; s/clang$/size/; s/^cc$/size/')"
+command -v "$SIZE" >/dev/null 2>&1 || SIZE=size
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+
+ALL="-DJSONB_CONFIG_NO_FLOAT -DJSONB_CONFIG_NO_INT64 -DJSONB_CONFIG_NO_BINZ -DJSONB_CONFIG_UNCHECKED"
+
+printf "%-36s %8s %8s %8s\n" "configuration" "text" "fmt ns" "parse ns"
+for CONFIG in "" \
+    "-DJSONB_CONFIG_NO_FLOAT" \
+    "-DJSONB_CONFIG_NO_INT64" \
+    "-DJSONB_CONFIG_NO_BINZ" \
+    "-DJSONB_CONFIG_NO_GROW" \
+    "-DJSONB_CONFIG_UNCHECKED" \
+    "$ALL"
+do
+    NAME="$(echo "${CONFIG:-default}" | sed 's/-DJSONB_CONFIG_//g')"
+    [ "$CONFIG" = "$ALL" ] && NAME="all of the above"
+    # shellcheck disable=SC2086
+    "$CC" -std=c99 -Os $CFLAGS $CONFIG -c jsonb.c -o "$TMP/jsonb.o"
+    TEXT="$("$SIZE" "$TMP/jsonb.o" | awk 'NR==2 {print $1}')"
+    FMT="-"
+    PARSE="-"
+    if [ "$CC" = "cc" ] || [ "$CC" = "gcc" ] || [ "$CC" = "clang" ]; then
+        # shellcheck disable=SC2086
+        "$CC" -std=gnu99 -O2 $CONFIG jsonb.c tools/jsonbbench.c -o "$TMP/bench"
+        set -- $("$TMP/bench")
+        FMT="$1"
+        PARSE="$2"
+    fi
+    printf "%-36s %8s %8s %8s\n" "$NAME" "$TEXT" "$FMT" "$PARSE"
+done
@@ -0,0 +1,291 @@
+// Copyright 2024 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Host check of notecardco.hpp against a simulated Notecard, in the virtual
+// time of the executor unless noted, so that the scheduling of transactions
+// can be verified without hardware:
+//
+//  cc -std=gnu99 -c soi2c.c -o soi2c.o
+//  c++ -std=c++20 -pthread tools/notecardcosim.cpp soi2c.o -o notecardcosim && ./notecardcosim
+//
+// The simulated Notecard answers each request by echoing it, after being
+// busy for a while after each chunk and refusing any chunk sent sooner.  Each
+// case prints a line, and the exit status is the number of cases that failed.
+
+#include <stdio.h>
+#include <string.h>
+#include <optional>
+#include <string>
+#include <thread>
+#include "../notecardco.hpp"
+
+namespace {
+
+constexpr uint64_t busyUs = 30000;
+constexpr uint64_t latencyUs = 50000;
+
+struct SimNotecard {
+    notecard::Executor *ex = nullptr;
+    uint64_t busyUntilUs = 0;
+    uint64_t rspAtUs = 0;
+    std::string req;
+    std::string rsp;
+    uint32_t rspOff = 0;
+    uint8_t want = 0;
+    int overlaps = 0;
+};
+
+SimNotecard sim;
+
+uint32_t simMicros()
+{
+    return (uint32_t) sim.ex->now();
+}
+
+bool simTransmit(void *, uint16_t, uint8_t *buf, uint16_t buflen)
+{
+    if (buflen == 2 && buf[0] == 0) {
+        sim.want = buf[1];
+        return true;
+    }
+    uint64_t now = sim.ex->now();
+    if (now < sim.busyUntilUs) {
+        return false;
+    }
+
+    // A request begun before the last response was read means two transactions
+    // were interleaved
+    if (sim.req.empty() && sim.rspOff < sim.rsp.size()) {
+        sim.overlaps++;
+    }
+    sim.busyUntilUs = now + busyUs;
+    sim.req.append((const char *) &buf[1], buf[0]);
+    if (sim.req.back() == '\n') {
+        sim.req.pop_back();
+        sim.rsp = "{\"echo\":\"" + sim.req + "\"}\n";
+        sim.rspOff = 0;
+        sim.req.clear();
+        sim.rspAtUs = now + latencyUs;
+    }
+    return true;
+}
+
+bool simReceive(void *, uint16_t, uint8_t *buf, uint16_t buflen)
+{
+    uint32_t avail = (sim.ex->now() >= sim.rspAtUs) ? (uint32_t) sim.rsp.size() - sim.rspOff : 0;
+    uint8_t n = sim.want;
+    if (buflen != n+2) {
+        return false;
+    }
+    if (n > avail) {
+        n = (uint8_t) avail;
+    }
+    memcpy(&buf[2], sim.rsp.data() + sim.rspOff, n);
+    sim.rspOff += n;
+    avail -= n;
+    buf[0] = (avail > 253) ? 253 : (uint8_t) avail;
+    buf[1] = n;
+    return true;
+}
+
+soi2cContext_t simContext(notecard::Executor &ex)
+{
+    sim = SimNotecard();
+    sim.ex = &ex;
+    soi2cContext_t ctx {};
+    ctx.tx = simTransmit;
+    ctx.rx = simReceive;
+    ctx.micros = simMicros;
+    return ctx;
+}
+
+int failures = 0;
+
+void report(const char *name, bool ok, const char *detail)
+{
+    printf("%-4s %-32s %s\n", ok ? "ok" : "FAIL", name, detail);
+    if (!ok) {
+        failures++;
+    }
+}
+
+constexpr int queued = 8;
+uint8_t txbuf[queued][512];
+uint8_t rxbuf[queued][512];
+int status[queued];
+int finished[queued];
+int finishedCount;
+
+std::string request(int i)
+{
+    return "req" + std::to_string(i) + std::string(i * 40, 'x');
+}
+
+// Alternate in-place and separate-buffer transactions
+notecard::Task<> transact(notecard::AsyncTransport &nc, int i)
+{
+    std::string req = request(i) + "\n";
+    memcpy(txbuf[i], req.data(), req.size());
+    if ((i & 1) != 0) {
+        status[i] = co_await nc.transact(0, txbuf[i], (uint32_t) req.size(), rxbuf[i], sizeof(rxbuf[i]));
+    } else {
+        status[i] = co_await nc.transact(0, txbuf[i], sizeof(txbuf[i]));
+    }
+    finished[finishedCount++] = i;
+}
+
+// Transactions awaited at once on one transport run in turn, each with its
+// own response
+void checkQueued()
+{
+    notecard::Executor ex;
+    soi2cContext_t ctx = simContext(ex);
+    notecard::AsyncTransport nc(ctx, ex);
+    finishedCount = 0;
+    for (int i=0; i<queued; i++) {
+        status[i] = -1;
+        ex.spawn(transact(nc, i));
+    }
+    ex.run();
+    bool ok = sim.overlaps == 0 && finishedCount == queued;
+    for (int i=0; i<queued; i++) {
+        std::string want = "{\"echo\":\"" + request(i) + "\"}\n";
+        const uint8_t *got = ((i & 1) != 0) ? rxbuf[i] : txbuf[i];
+        ok = ok && status[i] == STATUS_OK && finished[i] == i && memcmp(got, want.data(), want.size()) == 0;
+    }
+    char detail[128];
+    snprintf(detail, sizeof(detail), "%d transactions, %d overlapped, %llums", finishedCount, sim.overlaps, (unsigned long long) ex.now() / 1000);
+    report("queued transactions", ok, detail);
+}
+
+int readyStatus;
+
+notecard::Task<> sendLong(notecard::AsyncTransport &nc, uint8_t *buf, uint32_t buflen)
+{
+    readyStatus = co_await nc.transact(SOI2C_NO_RESPONSE, buf, buflen);
+}
+
+// Signal ready once during the floor after the first chunk, which is ignored,
+// and then each time the Notecard is no longer busy, which ends the gap
+notecard::Task<> signalReady(notecard::Executor &ex, notecard::AsyncTransport &nc)
+{
+    co_await ex.sleep(1000);
+    nc.ready();
+    co_await ex.sleep((uint32_t) busyUs);
+    nc.ready();
+    co_await ex.sleep((uint32_t) busyUs);
+    nc.ready();
+}
+
+// A ready signal ends the rest of a gap early, but not its floor
+void checkReady()
+{
+    notecard::Executor ex;
+    soi2cContext_t ctx = simContext(ex);
+    notecard::AsyncTransport nc(ctx, ex);
+    static uint8_t buf[512];
+    memset(buf, 'a', 300);
+    buf[300] = '\n';
+    readyStatus = -1;
+    ex.spawn(sendLong(nc, buf, sizeof(buf)));
+    ex.spawn(signalReady(ex, nc));
+    ex.run();
+    char detail[128];
+    snprintf(detail, sizeof(detail), "status %d, %llums rather than 500", readyStatus, (unsigned long long) ex.now() / 1000);
+    report("ready ends gap early", readyStatus == STATUS_OK && ex.now() < 100000, detail);
+}
+
+// As above, but signalled by another thread while the executor runs in real time
+void checkReadyThread()
+{
+    notecard::Executor ex(true);
+    soi2cContext_t ctx = simContext(ex);
+    notecard::AsyncTransport nc(ctx, ex);
+    static uint8_t buf[512];
+    memset(buf, 'a', 300);
+    buf[300] = '\n';
+    readyStatus = -1;
+    ex.spawn(sendLong(nc, buf, sizeof(buf)));
+    std::thread pin([&nc] {
+        for (int i=0; i<2; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(40));
+            nc.ready();
+        }
+    });
+    ex.run();
+    pin.join();
+    char detail[128];
+    snprintf(detail, sizeof(detail), "status %d, %llums rather than 500", readyStatus, (unsigned long long) ex.now() / 1000);
+    report("ready from another thread", readyStatus == STATUS_OK && ex.now() < 300000, detail);
+}
+
+// Awaits a task without owning it, so that it can be destroyed meanwhile
+struct Borrowed {
+    notecard::Task<int> &task;
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        return task.await_suspend(h);
+    }
+    int await_resume() noexcept
+    {
+        return task.await_resume();
+    }
+};
+
+std::optional<notecard::Task<int>> victim;
+
+notecard::Task<> awaitVictim()
+{
+    co_await Borrowed { *victim };
+}
+
+notecard::Task<> destroyVictim(notecard::Executor &ex, uint32_t us)
+{
+    co_await ex.sleep(us);
+    victim.reset();
+}
+
+// Destroying a task, whether it is queued or running, withdraws it and lets
+// the rest run
+void checkDestroyed(bool running)
+{
+    notecard::Executor ex;
+    soi2cContext_t ctx = simContext(ex);
+    notecard::AsyncTransport nc(ctx, ex);
+
+    // The Notecard may still be busy with the abandoned request, so the next
+    // one must be able to back off
+    ctx.chunkGapMaxMs = 1000;
+    finishedCount = 0;
+    status[0] = status[2] = -1;
+    if (!running) {
+        ex.spawn(transact(nc, 0));
+    }
+    memcpy(txbuf[1], "{}\n", 3);
+    victim.emplace(nc.transact(0, txbuf[1], sizeof(txbuf[1])));
+    ex.spawn(awaitVictim());
+    ex.spawn(transact(nc, 2));
+    ex.spawn(destroyVictim(ex, running ? 10000 : 1000));
+    ex.run();
+    bool ok = status[2] == STATUS_OK && (running || status[0] == STATUS_OK) && ctx.op.state == 0 && finishedCount == (running ? 1 : 2);
+    char detail[128];
+    snprintf(detail, sizeof(detail), "%d others finished, %llums", finishedCount, (unsigned long long) ex.now() / 1000);
+    report(running ? "running task destroyed" : "queued task destroyed", ok, detail);
+}
+
+} // namespace
+
+int main()
+{
+    checkQueued();
+    checkReady();
+    checkReadyThread();
+    checkDestroyed(false);
+    checkDestroyed(true);
+    return failures;
+}
@@ -0,0 +1,275 @@
+// Copyright 2024 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+// Host check of soi2c against a simulated Notecard in virtual time, so that
+// the pacing, retry and timeout paths can be verified without hardware:
+//
+//  cc -std=gnu99 soi2c.c tools/soi2csim.c -o soi2csim && ./soi2csim
+//
+// The simulated Notecard is busy for a while after each chunk, refusing any
+// chunk sent sooner, and answers each request after a latency.  Its ATTN pin
+// is asserted whenever it isn't busy.  Each case prints a line, and the exit
+// status is the number of cases that failed.
+
+#include <stdio.h>
+#include <string.h>
+#include "../soi2c.h"
+
+#define SIM_BUSY_US         30000
+#define SIM_LATENCY_US      80000
+
+typedef struct {
+    uint64_t nowUs;
+    uint64_t busyUntilUs;
+    uint64_t rspAtUs;
+    bool rspNever;
+    int refuse;
+    uint8_t want;
+    char req[2048];
+    uint32_t reqLen;
+    const char *rsp;
+    uint32_t rspOff;
+    uint64_t lastChunkUs;
+    uint64_t minChunkGapUs;
+    int chunks;
+    int waits;
+} simNotecard;
+
+static simNotecard sim;
+
+static uint32_t simMicros(void)
+{
+    return (uint32_t) sim.nowUs;
+}
+
+static void simDelay(uint32_t ms)
+{
+    sim.nowUs += ms * 1000ULL;
+}
+
+static void simDelayUs(uint32_t us)
+{
+    sim.nowUs += us;
+}
+
+static bool simTransmit(void *port, uint16_t addr, uint8_t *buf, uint16_t buflen)
+{
+    (void) port;
+    (void) addr;
+    sim.nowUs += 100;
+
+    // A request to read
+    if (buflen == 2 && buf[0] == 0) {
+        sim.want = buf[1];
+        return true;
+    }
+
+    // A chunk, refused while busy
+    if (sim.nowUs < sim.busyUntilUs || sim.refuse > 0) {
+        if (sim.refuse > 0) {
+            sim.refuse--;
+        }
+        return false;
+    }
+    if (sim.chunks > 0 && sim.nowUs - sim.lastChunkUs < sim.minChunkGapUs) {
+        sim.minChunkGapUs = sim.nowUs - sim.lastChunkUs;
+    }
+    sim.lastChunkUs = sim.nowUs;
+    sim.chunks++;
+    memcpy(&sim.req[sim.reqLen], &buf[1], buf[0]);
+    sim.reqLen += buf[0];
+    sim.busyUntilUs = sim.nowUs + SIM_BUSY_US;
+    if (sim.req[sim.reqLen-1] == '\n') {
+        sim.rspAtUs = sim.rspNever ? UINT64_MAX : sim.nowUs + SIM_LATENCY_US;
+    }
+    return true;
+}
+
+static bool simReceive(void *port, uint16_t addr, uint8_t *buf, uint16_t buflen)
+{
+    (void) port;
+    (void) addr;
+    sim.nowUs += 200;
+    uint32_t avail = (sim.rspAtUs != 0 && sim.nowUs >= sim.rspAtUs) ? (uint32_t) strlen(sim.rsp) - sim.rspOff : 0;
+    uint8_t n = sim.want;
+    if (buflen != n+2) {
+        return false;
+    }
+    if (n > avail) {
+        n = (uint8_t) avail;
+    }
+    memcpy(&buf[2], &sim.rsp[sim.rspOff], n);
+    sim.rspOff += n;
+    avail -= n;
+    buf[0] = (avail > 253) ? 253 : (uint8_t) avail;
+    buf[1] = n;
+    return true;
+}
+
+// ATTN, asserted once the Notecard is no longer busy and, if a response is
+// on its way, once it is ready
+static bool simWaitReady(void *port, uint32_t timeoutUs)
+{
+    (void) port;
+    sim.waits++;
+    uint64_t readyUs = sim.busyUntilUs;
+    if (sim.rspAtUs != 0 && sim.rspAtUs > readyUs) {
+        readyUs = sim.rspAtUs;
+    }
+    if (readyUs <= sim.nowUs + timeoutUs) {
+        if (readyUs > sim.nowUs) {
+            sim.nowUs = readyUs;
+        }
+        return true;
+    }
+    sim.nowUs += timeoutUs;
+    return false;
+}
+
+static void simReset(soi2cContext_t *ctx, const char *rsp, bool attn)
+{
+    memset(&sim, 0, sizeof(sim));
+    sim.rsp = rsp;
+    sim.minChunkGapUs = UINT64_MAX;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->tx = simTransmit;
+    ctx->rx = simReceive;
+    ctx->delay = simDelay;
+    ctx->delayUs = simDelayUs;
+    ctx->micros = simMicros;
+    if (attn) {
+        ctx->waitReady = simWaitReady;
+    }
+}
+
+static int failures = 0;
+
+static void report(const char *name, bool ok, const char *detail)
+{
+    printf("%-4s %-32s %s\n", ok ? "ok" : "FAIL", name, detail);
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Fill a request of the given length, including its newline
+static uint32_t makeRequest(uint8_t *buf, uint32_t len)
+{
+    for (uint32_t i=0; i<len-1; i++) {
+        buf[i] = (uint8_t) ('a' + i % 26);
+    }
+    buf[len-1] = '\n';
+    return len;
+}
+
+// A request of several chunks and a response of several reads
+static void checkRoundTrip(bool attn)
+{
+    static char rsp[700];
+    memset(rsp, 'r', sizeof(rsp)-2);
+    rsp[sizeof(rsp)-2] = '\n';
+    rsp[sizeof(rsp)-1] = '\0';
+    static uint8_t buf[1024];
+    uint8_t req[701];
+    makeRequest(req, sizeof(req));
+    memcpy(buf, req, sizeof(req));
+
+    soi2cContext_t ctx;
+    simReset(&ctx, rsp, attn);
+    int status = soi2cTransaction(&ctx, 0, buf, sizeof(buf));
+    bool ok = status == STATUS_OK && sim.reqLen == sizeof(req) && memcmp(sim.req, req, sizeof(req)) == 0
+              && ctx.bufused == strlen(rsp) && memcmp(ctx.buf, rsp, ctx.bufused) == 0;
+    char detail[128];
+    snprintf(detail, sizeof(detail), "status %d, %d chunks, %llums, shortest gap %lluus, %d ready waits", status, sim.chunks,
+             (unsigned long long) sim.nowUs / 1000, (unsigned long long) sim.minChunkGapUs, sim.waits);
+    report(attn ? "round trip, ready signal" : "round trip", ok, detail);
+
+    // With the ready signal, no chunk may follow another sooner than the floor
+    if (attn) {
+        soi2cTiming_t timing = SOI2C_TIMING_DEFAULTS;
+        ok = sim.minChunkGapUs >= timing.readyMinUs && sim.nowUs < 500000;
+        report("ready signal keeps floor", ok, detail);
+    }
+}
+
+// Refused chunks are retried after a longer gap, until the gap can't grow
+static void checkBackOff(void)
+{
+    static uint8_t buf[64];
+    char detail[128];
+    soi2cContext_t ctx;
+
+    simReset(&ctx, "{}\n", false);
+    sim.refuse = 2;
+    ctx.chunkGapMinMs = 50;
+    ctx.chunkGapMaxMs = 400;
+    makeRequest(buf, 20);
+    int status = soi2cTransaction(&ctx, 0, buf, sizeof(buf));
+    snprintf(detail, sizeof(detail), "status %d, %u retries, %llums", status, (unsigned) ctx.stats.retries, (unsigned long long) sim.nowUs / 1000);
+    report("refused chunk backs off", status == STATUS_OK && ctx.stats.retries == 2, detail);
+
+    simReset(&ctx, "{}\n", false);
+    sim.refuse = 10;
+    ctx.chunkGapMinMs = 50;
+    ctx.chunkGapMaxMs = 100;
+    makeRequest(buf, 20);
+    status = soi2cTransaction(&ctx, 0, buf, sizeof(buf));
+    snprintf(detail, sizeof(detail), "status %d, %u retries", status, (unsigned) ctx.stats.retries);
+    report("refused chunk gives up", status == STATUS_IO_TRANSMIT && ctx.stats.retries == 1, detail);
+}
+
+// A response that never comes times out after the requested seconds
+static void checkTimeout(bool attn)
+{
+    static uint8_t buf[64];
+    soi2cContext_t ctx;
+    simReset(&ctx, "{}\n", attn);
+    sim.rspNever = true;
+    makeRequest(buf, 20);
+    int status = soi2cTransaction(&ctx, SOI2C_TIMEOUT(2), buf, sizeof(buf));
+    char detail[128];
+    snprintf(detail, sizeof(detail), "status %d, %llums", status, (unsigned long long) sim.nowUs / 1000);
+    bool ok = status == STATUS_IO_TIMEOUT && sim.nowUs >= 2000000 && sim.nowUs < 2400000;
+    report(attn ? "response timeout, ready signal" : "response timeout", ok, detail);
+}
+
+// Stepping by hand, a wait that may end on the ready signal does so early in
+// virtual time, while the floor after each chunk is waited out in full
+static void checkStepWake(void)
+{
+    static uint8_t buf[1024];
+    soi2cContext_t ctx;
+    simReset(&ctx, "{}\n", false);
+    makeRequest(buf, 600);
+    int status = soi2cBegin(&ctx, SOI2C_NO_RESPONSE, buf, sizeof(buf));
+    int early = 0;
+    while (status == STATUS_PENDING) {
+        uint32_t waitUs;
+        bool untilReady;
+        status = soi2cStep(&ctx, &waitUs, &untilReady);
+        if (status != STATUS_PENDING) {
+            break;
+        }
+        if (untilReady && sim.busyUntilUs < sim.nowUs + waitUs) {
+            sim.nowUs = (sim.busyUntilUs > sim.nowUs) ? sim.busyUntilUs : sim.nowUs;
+            early++;
+        } else {
+            sim.nowUs += waitUs;
+        }
+    }
+    char detail[128];
+    snprintf(detail, sizeof(detail), "status %d, %d waits ended early, %llums", status, early, (unsigned long long) sim.nowUs / 1000);
+    report("stepped wait ends early", status == STATUS_OK && early == 3 && sim.nowUs < 200000, detail);
+}
+
+int main(void)
+{
+    checkRoundTrip(false);
+    checkRoundTrip(true);
+    checkBackOff();
+    checkTimeout(false);
+    checkTimeout(true);
+    checkStepWake();
+    return failures;
+}